@@ -0,0 +1,82 @@
+// Copyright (C) 2025 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <string_view>
+
+// The characters of generated names. The first NameLetters of them are letters; a name always
+// starts with one of those, so it is a valid identifier.
+constexpr std::string_view NameCharset = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234"
+                                         "56789";
+constexpr size_t           NameLetters = 52;
+
+// Generator of random names, built on xoshiro256** (Blackman and Vigna). Like the std::mt19937 it
+// replaces, it is not cryptographically secure; it is several times faster, and the names are
+// written straight into their destination.
+class NameGenerator
+{
+public:
+    // Expands Seed into the state with SplitMix64, as recommended by the authors of xoshiro.
+    explicit NameGenerator(uint64_t Seed)
+    {
+        for (uint64_t& Word : State) {
+            Seed += 0x9e3779b97f4a7c15;
+            uint64_t Mixed = Seed;
+            Mixed          = (Mixed ^ (Mixed >> 30)) * 0xbf58476d1ce4e5b9;
+            Mixed          = (Mixed ^ (Mixed >> 27)) * 0x94d049bb133111eb;
+            Word           = Mixed ^ (Mixed >> 31);
+        }
+    }
+
+    explicit NameGenerator(std::random_device& Entropy) :
+        NameGenerator(uint64_t(Entropy()) << 32 | Entropy())
+    {}
+
+    uint64_t next()
+    {
+        const uint64_t Result  = std::rotl(State[1] * 5, 7) * 9;
+        const uint64_t Shifted = State[1] << 17;
+
+        State[2] ^= State[0];
+        State[3] ^= State[1];
+        State[1] ^= State[2];
+        State[0] ^= State[3];
+        State[2] ^= Shifted;
+        State[3] = std::rotl(State[3], 45);
+        return Result;
+    }
+
+    // Fills Name with random alphanumeric characters, the first one a letter. Each 64-bit draw is
+    // cut into ten 6-bit indices into the alphabet; indices past its end are rejected, so every
+    // character is exactly uniform. Rejection does not branch: the character is always stored,
+    // and the position only advances if it was accepted.
+    void fill(std::span<char> Name)
+    {
+        size_t Pos = 0;
+        while (Pos < Name.size()) {
+            uint64_t Bits = next();
+            for (unsigned Field = 0; Field < 10 && Pos < Name.size(); ++Field, Bits >>= 6) {
+                const unsigned Index = Bits & 63;
+                Name[Pos]            = Alphabet[Index];
+                Pos += Index < (Pos == 0 ? NameLetters : NameCharset.size());
+            }
+        }
+    }
+
+private:
+    // NameCharset padded to 64 entries, so that any 6-bit index can be looked up.
+    static constexpr std::array<char, 64> Alphabet = [] {
+        std::array<char, 64> Table {};
+        for (size_t Index = 0; Index < Table.size(); ++Index)
+            Table[Index] = NameCharset[Index % NameCharset.size()];
+        return Table;
+    }();
+
+    std::array<uint64_t, 4> State;
+};
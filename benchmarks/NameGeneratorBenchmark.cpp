@@ -0,0 +1,87 @@
+// Copyright (C) 2025 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+// Throughput of NameGenerator compared to the std::mt19937 based generators it replaced.
+// Usage: name_generator_benchmark [NAME_COUNT [NAME_LENGTH]]
+
+#include "NameGenerator.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The original generator: one string per name, built a character at a time.
+std::string generateRandomString(size_t length, std::mt19937& generator)
+{
+    const std::string                  charset(NameCharset);
+    std::uniform_int_distribution<int> distribution(0, charset.length() - 1);
+    std::string                        result;
+    for (size_t i = 0; i < length; ++i)
+        result += charset[distribution(generator)];
+    return result;
+}
+
+// Its in-place successor, still drawing each character from a distribution over std::mt19937.
+void fillRandomName(std::span<char> Name, std::mt19937& Generator)
+{
+    std::uniform_int_distribution<int> Distribution(0, NameCharset.size() - 1);
+    for (char& C : Name)
+        C = NameCharset[Distribution(Generator)];
+}
+
+// Runs Fill for each name in Buffer and prints the throughput. The checksum keeps the compiler
+// from dropping the work.
+template <typename FillT>
+void measure(const char* Label, std::vector<char>& Buffer, size_t NameLength, FillT&& Fill)
+{
+    const size_t NameCount = Buffer.size() / NameLength;
+    const auto   Start     = std::chrono::steady_clock::now();
+    for (size_t Index = 0; Index < NameCount; ++Index)
+        Fill(std::span<char>(Buffer.data() + Index * NameLength, NameLength));
+    const auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start);
+
+    unsigned Checksum = 0;
+    for (char C : Buffer)
+        Checksum = Checksum * 31 + static_cast<unsigned char>(C);
+
+    const double Seconds = Elapsed.count();
+    printf("%-34s %8.1f ns/name %8.1f MB/s   (checksum %08x)\n",
+           Label,
+           Seconds * 1e9 / NameCount,
+           Buffer.size() / Seconds / 1e6,
+           Checksum);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t NameCount  = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    const size_t NameLength = argc > 2 ? strtoull(argv[2], nullptr, 10) : 24;
+    if (NameCount == 0 || NameLength == 0) {
+        fprintf(stderr, "Usage: %s [NAME_COUNT [NAME_LENGTH]]\n", argv[0]);
+        return 1;
+    }
+    printf("%zu names of %zu characters\n", NameCount, NameLength);
+
+    std::vector<char> Buffer(NameCount * NameLength);
+    std::mt19937      Twister(1);
+    NameGenerator     Generator(1);
+
+    measure("mt19937, std::string per name", Buffer, NameLength, [&](std::span<char> Name) {
+        const std::string Result = generateRandomString(Name.size(), Twister);
+        std::copy(Result.begin(), Result.end(), Name.begin());
+    });
+    measure("mt19937, in place", Buffer, NameLength, [&](std::span<char> Name) {
+        fillRandomName(Name, Twister);
+    });
+    measure("NameGenerator, in place", Buffer, NameLength, [&](std::span<char> Name) {
+        Generator.fill(Name);
+    });
+    return 0;
+}
@@ -1,35 +1,410 @@
 // Copyright (C) 2025 The Qt Company Ltd.
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
 
+#include "NameGenerator.h"
+
 #include <CLI/CLI.hpp>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/ADT/SmallString.h>
 #include <llvm/Object/MachO.h>
 #include <llvm/Object/MachOUniversal.h>
+#include <llvm/Support/DataExtractor.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/Errno.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Process.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <new>
 #include <optional>
 #include <random>
 #include <set>
 #include <string>
 #include <string_view>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#    include <linux/fs.h>
+#    include <sys/ioctl.h>
+#elif defined(__APPLE__)
+#    include <sys/clonefile.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#    include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#    include <arm_neon.h>
+#endif
+
 
 using namespace llvm;
 using namespace object;
 
+// Every heap allocation is counted, so that --stats can show that the per-name loops do not
+// allocate. All replaceable allocation functions are replaced, so every block, whichever form
+// allocated it, comes from malloc() or posix_memalign() and goes back through free().
+namespace {
+uint64_t HeapAllocations = 0;
+
+void* countedAllocate(std::size_t Size, std::size_t Alignment = 0) noexcept
+{
+    ++HeapAllocations;
+    Size = Size ? Size : 1;
+    if (Alignment <= alignof(std::max_align_t))
+        return std::malloc(Size);
+    void* Ptr = nullptr;
+    return posix_memalign(&Ptr, Alignment, Size) == 0 ? Ptr : nullptr;
+}
+
+void* countedAllocateOrThrow(std::size_t Size, std::size_t Alignment = 0)
+{
+    if (void* Ptr = countedAllocate(Size, Alignment))
+        return Ptr;
+    throw std::bad_alloc();
+}
+} // namespace
+
+void* operator new(std::size_t Size)
+{
+    return countedAllocateOrThrow(Size);
+}
+
+void* operator new[](std::size_t Size)
+{
+    return countedAllocateOrThrow(Size);
+}
+
+void* operator new(std::size_t Size, std::align_val_t Alignment)
+{
+    return countedAllocateOrThrow(Size, static_cast<std::size_t>(Alignment));
+}
+
+void* operator new[](std::size_t Size, std::align_val_t Alignment)
+{
+    return countedAllocateOrThrow(Size, static_cast<std::size_t>(Alignment));
+}
+
+void* operator new(std::size_t Size, const std::nothrow_t&) noexcept
+{
+    return countedAllocate(Size);
+}
+
+void* operator new[](std::size_t Size, const std::nothrow_t&) noexcept
+{
+    return countedAllocate(Size);
+}
+
+void* operator new(std::size_t Size, std::align_val_t Alignment, const std::nothrow_t&) noexcept
+{
+    return countedAllocate(Size, static_cast<std::size_t>(Alignment));
+}
+
+void* operator new[](std::size_t Size, std::align_val_t Alignment, const std::nothrow_t&) noexcept
+{
+    return countedAllocate(Size, static_cast<std::size_t>(Alignment));
+}
+
+// GCC pairs its own idea of operator new with the free() below once a delete is inlined, and warns
+// about a mismatch that cannot happen here.
+#if defined(__GNUC__) && !defined(__clang__)
+#    pragma GCC diagnostic push
+#    pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* Ptr) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete(void* Ptr, std::size_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr, std::size_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete(void* Ptr, std::align_val_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr, std::align_val_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete(void* Ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete(void* Ptr, const std::nothrow_t&) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr, const std::nothrow_t&) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete(void* Ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(Ptr);
+}
+
+void operator delete[](void* Ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(Ptr);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#    pragma GCC diagnostic pop
+#endif
+
 namespace {
 
+// How the patched bytes get back into the binary.
+enum class WriteMode
+{
+    // pwrite() only the patched ranges into the existing file.
+    Pwrite,
+    // Clone the file, write the patched ranges into the clone and atomically rename it over the
+    // output. Never leaves a partially written binary behind.
+    Copy,
+    // Map the file writable and shared, so only the pages holding patched bytes are touched.
+    Mmap,
+};
+
+// Key of the keyed-hash mode, in which each new name is derived from the original one.
+using HashKey = std::array<uint64_t, 2>;
+
+// SipHash-2-4 of Data under Key.
+uint64_t sipHash24(const HashKey& Key, StringRef Data)
+{
+    uint64_t V0 = 0x736f6d6570736575 ^ Key[0];
+    uint64_t V1 = 0x646f72616e646f6d ^ Key[1];
+    uint64_t V2 = 0x6c7967656e657261 ^ Key[0];
+    uint64_t V3 = 0x7465646279746573 ^ Key[1];
+
+    auto round = [&] {
+        V0 += V1;
+        V1 = std::rotl(V1, 13) ^ V0;
+        V0 = std::rotl(V0, 32);
+        V2 += V3;
+        V3 = std::rotl(V3, 16) ^ V2;
+        V0 += V3;
+        V3 = std::rotl(V3, 21) ^ V0;
+        V2 += V1;
+        V1 = std::rotl(V1, 17) ^ V2;
+        V2 = std::rotl(V2, 32);
+    };
+    auto compress = [&](uint64_t Word) {
+        V3 ^= Word;
+        round();
+        round();
+        V0 ^= Word;
+    };
+
+    const size_t FullWords = Data.size() & ~size_t(7);
+    for (size_t Pos = 0; Pos < FullWords; Pos += 8)
+        compress(support::endian::read64le(Data.data() + Pos));
+
+    // The last word holds the remaining bytes and the length of the data in its top byte.
+    uint64_t Last = uint64_t(Data.size()) << 56;
+    for (size_t Pos = FullWords; Pos < Data.size(); ++Pos)
+        Last |= uint64_t(static_cast<uint8_t>(Data[Pos])) << (8 * (Pos - FullWords));
+    compress(Last);
+
+    V2 ^= 0xff;
+    for (unsigned Round = 0; Round < 4; ++Round)
+        round();
+    return V0 ^ V1 ^ V2 ^ V3;
+}
+
+// Turns the text given with --key into a hash key.
+HashKey deriveHashKey(StringRef Text)
+{
+    return {sipHash24({0, 0}, Text), sipHash24({0, 1}, Text)};
+}
+
+// Finds the occurrences of a set of replacement patterns in a name in a single pass. The patterns
+// are compiled into an Aho-Corasick automaton, stored as a table of transitions for every byte, so
+// scanning a name is one table lookup per byte however many patterns there are. Matches are
+// reported leftmost-longest and never overlap, like repeated find() calls for a single pattern.
+class ReplacementMatcher
+{
+public:
+    struct Pair
+    {
+        std::string Pattern;
+        std::string Replacement;
+    };
+
+    // Builds the automaton. If a pattern is given twice, the first pair is used.
+    void compile(std::vector<Pair> NewPairs)
+    {
+        Pairs = std::move(NewPairs);
+        Next.assign(1, {});
+        Longest.assign(1, -1);
+        MaxLength = 0;
+
+        // The trie of all patterns; missing edges are 0 until the failure links are known.
+        for (size_t Index = 0; Index < Pairs.size(); ++Index) {
+            const std::string& Pattern = Pairs[Index].Pattern;
+            uint32_t           State   = 0;
+            for (unsigned char C : Pattern) {
+                if (Next[State][C] == 0) {
+                    Next[State][C] = Next.size();
+                    Next.push_back({});
+                    Longest.push_back(-1);
+                }
+                State = Next[State][C];
+            }
+            if (Longest[State] < 0)
+                Longest[State] = Index;
+            MaxLength = std::max(MaxLength, Pattern.size());
+        }
+
+        // Breadth first, turn the trie into a complete transition table: a missing edge continues
+        // from the failure state, the longest proper suffix of the state that is in the trie.
+        // Each state also inherits the longest pattern ending at its failure state.
+        std::vector<uint32_t> Fail(Next.size(), 0);
+        std::vector<uint32_t> Queue;
+        for (unsigned C = 0; C < 256; ++C) {
+            if (Next[0][C] != 0)
+                Queue.push_back(Next[0][C]);
+        }
+        for (size_t Head = 0; Head < Queue.size(); ++Head) {
+            const uint32_t State = Queue[Head];
+            if (Longest[State] < 0)
+                Longest[State] = Longest[Fail[State]];
+            for (unsigned C = 0; C < 256; ++C) {
+                const uint32_t Child = Next[State][C];
+                if (Child != 0 && Child != Next[Fail[State]][C]) {
+                    Fail[Child] = Next[Fail[State]][C];
+                    Queue.push_back(Child);
+                } else {
+                    Next[State][C] = Next[Fail[State]][C];
+                }
+            }
+        }
+    }
+
+    bool empty() const
+    {
+        return Pairs.empty();
+    }
+
+    ArrayRef<Pair> pairs() const
+    {
+        return Pairs;
+    }
+
+    // Calls Callback(Offset, Pair) for every match in Text, in order.
+    template <typename CallbackT>
+    void forEachMatch(StringRef Text, CallbackT&& Callback) const
+    {
+        size_t Cursor = 0;
+        while (Cursor < Text.size()) {
+            // The automaton restarts after each match, so no match can overlap an earlier one.
+            uint32_t State     = 0;
+            int32_t  Best      = -1;
+            size_t   BestStart = 0;
+            for (size_t Pos = Cursor; Pos < Text.size(); ++Pos) {
+                State = Next[State][static_cast<unsigned char>(Text[Pos])];
+                if (Longest[State] >= 0) {
+                    const size_t Start = Pos + 1 - Pairs[Longest[State]].Pattern.size();
+                    if (Best < 0 || Start <= BestStart) {
+                        Best      = Longest[State];
+                        BestStart = Start;
+                    }
+                }
+                // No match found later can start at or before BestStart.
+                if (Best >= 0 && Pos + 1 >= BestStart + MaxLength)
+                    break;
+            }
+            if (Best < 0)
+                return;
+            Callback(BestStart, Pairs[Best]);
+            Cursor = BestStart + Pairs[Best].Pattern.size();
+        }
+    }
+
+private:
+    std::vector<Pair>                      Pairs;
+    std::vector<std::array<uint32_t, 256>> Next;
+    std::vector<int32_t>                   Longest; // Index of the longest pattern ending here
+    size_t                                 MaxLength = 0;
+};
+
 // Struct to hold all command line arguments, returned by the parser.
 struct CommandLineArgs
 {
-    std::string           binaryPath;
-    std::set<std::string> excludedClasses;
-    bool                  quietMode {false};
-    bool                  dryRun {false};
-    std::string           pattern;
-    std::string           replacement;
+    std::string                        binaryPath;
+    std::string                        outputPath;
+    std::set<std::string, std::less<>> excludedClasses;
+    std::set<std::string>              archs;
+    std::set<uint32_t>                 platforms;
+    bool                               quietMode {false};
+    bool                               stats {false};
+    bool                               dryRun {false};
+    WriteMode                          writeMode {WriteMode::Pwrite};
+    std::string                        exportPlanPath;
+    std::string                        applyPlanPath;
+    std::string                        layoutCachePath;
+    std::string                        mappingDatabasePath;
+    unsigned                           variants {0};
+    std::string                        outputTemplate;
+    ReplacementMatcher                 replacer;
+    std::optional<HashKey>             hashKey;
+
+    // Whether the binary is piped through stdin and/or stdout.
+    bool isStreaming() const
+    {
+        return binaryPath == "-" || outputPath == "-";
+    }
+
+    // Progress messages go to stdout, unless stdout carries the patched binary.
+    raw_ostream& log() const
+    {
+        return outputPath == "-" ? errs() : outs();
+    }
 };
 
+// Platforms of LC_BUILD_VERSION that MachO::PlatformType only gained after LLVM 14, with the
+// values of <mach-o/loader.h>.
+constexpr uint32_t PlatformXROS          = 11;
+constexpr uint32_t PlatformXROSSimulator = 12;
+
 // New function to parse command line arguments using CLI11.
 // Returns an optional struct. If parsing fails or --help is used,
 // it returns std::nullopt.
@@ -39,38 +414,184 @@ std::optional<CommandLineArgs> parseCommandLine(int argc, char** argv)
     CLI::App app {"A tool to patch Objective-C metadata in Mach-O binaries."};
 
     // Positional argument for the file to patch.
-    app.add_option("binary_to_patch", args.binaryPath, "The binary file to patch")
+    app.add_option("binary_to_patch", args.binaryPath, "The binary file to patch, or - for stdin")
         ->required()
-        ->check(CLI::ExistingFile);
+        ->check(CLI::ExistingFile | CLI::IsMember(std::vector<std::string> {"-"}));
+
+    // Optional output path; without it the binary is patched in place.
+    auto* outputOpt = app.add_option("-o,--output",
+                                     args.outputPath,
+                                     "Write the patched binary here instead of in place, or to "
+                                     "stdout for -");
+    outputOpt->type_name("PATH");
 
     // Flags for quiet mode and dry run.
     app.add_flag("--quiet", args.quietMode, "Suppress output messages");
     app.add_flag("--dry-run", args.dryRun, "Perform a dry run without modifying the file");
+    app.add_flag(
+        "--stats",
+        args.stats,
+        "Report name collisions, the heap allocations of the per-name loops and the category "
+        "names read from __objc_catlist, even if quiet");
+
+    // Strategy for writing the patched bytes back to the file.
+    const std::map<std::string, WriteMode> writeModes {
+        {"pwrite", WriteMode::Pwrite},
+        {"copy", WriteMode::Copy},
+        {"mmap", WriteMode::Mmap},
+    };
+    auto* writeModeOpt
+        = app.add_option("--write-mode",
+                         args.writeMode,
+                         "How to write the patched binary in place: 'pwrite' (default) writes only "
+                         "the patched ranges, 'copy' patches a clone and renames it over the file, "
+                         "'mmap' patches it through a shared writable mapping")
+              ->transform(CLI::CheckedTransformer(writeModes))
+              ->type_name("MODE");
 
     // Option to exclude classes, can be used multiple times.
-    app.add_option("--exclude", args.excludedClasses, "List of class names to exclude from patching")
-        ->type_name("CLASS");
+    auto* excludeOpt = app.add_option(
+        "--exclude", args.excludedClasses, "List of class names to exclude from patching");
+    excludeOpt->type_name("CLASS");
 
-    // Option for replacement mode. Takes two arguments: pattern and replacement.
+    // Slice selection; other slices of a universal binary are left untouched and are not parsed.
+    app.add_option("--arch", args.archs, "Only patch slices of these architectures, e.g. arm64")
+        ->type_name("ARCH");
+    const std::map<std::string, uint32_t> platformNames {
+        {"macos", MachO::PLATFORM_MACOS},
+        {"ios", MachO::PLATFORM_IOS},
+        {"tvos", MachO::PLATFORM_TVOS},
+        {"watchos", MachO::PLATFORM_WATCHOS},
+        {"bridgeos", MachO::PLATFORM_BRIDGEOS},
+        {"maccatalyst", MachO::PLATFORM_MACCATALYST},
+        {"iossimulator", MachO::PLATFORM_IOSSIMULATOR},
+        {"tvossimulator", MachO::PLATFORM_TVOSSIMULATOR},
+        {"watchossimulator", MachO::PLATFORM_WATCHOSSIMULATOR},
+        {"driverkit", MachO::PLATFORM_DRIVERKIT},
+        {"xros", PlatformXROS},
+        {"xrossimulator", PlatformXROSSimulator},
+    };
+    app.add_option("--platform",
+                   args.platforms,
+                   "Only patch slices built for these platforms, e.g. ios or iossimulator")
+        ->transform(CLI::CheckedTransformer(platformNames))
+        ->type_name("PLATFORM");
+
+    // Option for replacement mode. Takes two arguments: pattern and replacement; can be used
+    // multiple times.
     std::vector<std::string> replace_args;
-    app.add_option("--replace", replace_args, "Replace a pattern with a replacement string")
-        ->expected(2)
-        ->type_name("PATTERN REPLACEMENT");
+    auto*                    replaceOpt
+        = app.add_option("--replace",
+                         replace_args,
+                         "Replace a pattern with a replacement string; can be repeated")
+              ->expected(2)
+              ->take_all()
+              ->type_name("PATTERN REPLACEMENT");
+
+    // Patch plans: record the edits of a run, or replay recorded edits without parsing the binary.
+    auto* exportPlanOpt = app.add_option(
+        "--export-plan", args.exportPlanPath, "Save the edits of this run as a patch plan");
+    exportPlanOpt->type_name("PATH");
+    app.add_option("--apply-plan",
+                   args.applyPlanPath,
+                   "Apply a patch plan exported from a byte-identical binary instead of "
+                   "searching the binary for names")
+        ->type_name("PATH")
+        ->check(CLI::ExistingFile)
+        ->excludes(excludeOpt)
+        ->excludes(replaceOpt)
+        ->excludes(exportPlanOpt);
+
+    // Cache of the name index, so that an unchanged binary is not parsed again.
+    app.add_option("--layout-cache",
+                   args.layoutCachePath,
+                   "Reuse the layout of unchanged binaries recorded in this file across runs")
+        ->type_name("PATH");
+
+    // Several differently randomized copies from a single parse of the binary.
+    auto* variantsOpt = app.add_option(
+        "--variants", args.variants, "Write N independently randomized copies of the binary");
+    variantsOpt->type_name("N")->check(CLI::PositiveNumber);
+    app.add_option("--output-template",
+                   args.outputTemplate,
+                   "Output path of each variant; %d is replaced by the variant number")
+        ->type_name("TEMPLATE")
+        ->needs(variantsOpt);
+
+    // Reproducible names: the same key always maps a name to the same new name.
+    std::string keyText;
+    auto*       keyOpt = app.add_option(
+        "--key,--seed",
+        keyText,
+        "Derive each new name from a keyed hash of the original name instead of randomly, so "
+        "that every run with the same KEY produces the same output");
+    keyOpt->type_name("KEY")->excludes(replaceOpt)->excludes(variantsOpt);
+
+    // What every name became, kept across runs.
+    app.add_option("--mapping-db",
+                   args.mappingDatabasePath,
+                   "Reuse the new names recorded in this database, and record the new names of "
+                   "this run in it")
+        ->type_name("PATH")
+        ->excludes(replaceOpt)
+        ->excludes(variantsOpt);
 
     // Custom validation logic after parsing.
     app.callback([&]() {
+        // A binary read from stdin is written to stdout unless told otherwise.
+        if (args.binaryPath == "-" && args.outputPath.empty())
+            args.outputPath = "-";
+
+        // Writing to a separate output always goes through a patched clone.
+        if (!args.outputPath.empty()) {
+            if (*writeModeOpt && args.writeMode != WriteMode::Copy)
+                throw CLI::ValidationError(
+                    "Error: --output and stdin can only be used with --write-mode copy.");
+            args.writeMode = WriteMode::Copy;
+        }
+
+        if ((!args.applyPlanPath.empty() || !args.exportPlanPath.empty()) && args.isStreaming())
+            throw CLI::ValidationError(
+                "Error: patch plans cannot be used with stdin or stdout.");
+        if (!args.layoutCachePath.empty() && (args.isStreaming() || !args.applyPlanPath.empty()))
+            throw CLI::ValidationError(
+                "Error: --layout-cache cannot be used with stdin, stdout or --apply-plan.");
+        if (!args.mappingDatabasePath.empty()
+            && (args.isStreaming() || !args.applyPlanPath.empty()))
+            throw CLI::ValidationError(
+                "Error: --mapping-db cannot be used with stdin, stdout or --apply-plan.");
+
+        if (args.variants != 0) {
+            if (args.outputTemplate.find("%d") == std::string::npos)
+                throw CLI::ValidationError(
+                    "Error: --variants requires an --output-template containing %d.");
+            if (!args.outputPath.empty() || !args.applyPlanPath.empty()
+                || !args.exportPlanPath.empty() || *writeModeOpt)
+                throw CLI::ValidationError("Error: --variants cannot be combined with --output, "
+                                           "--write-mode, stdin or patch plans.");
+        }
+
+        if (*keyOpt)
+            args.hashKey = deriveHashKey(keyText);
+
         if (!replace_args.empty()) {
-            args.pattern     = replace_args[0];
-            args.replacement = replace_args[1];
+            std::vector<ReplacementMatcher::Pair> pairs;
+            for (size_t i = 0; i + 1 < replace_args.size(); i += 2) {
+                const std::string& pattern     = replace_args[i];
+                const std::string& replacement = replace_args[i + 1];
 
-            if (args.pattern.empty()) {
-                throw CLI::ValidationError("Error: replacement pattern cannot be empty.");
-            }
-            if (args.pattern.length() != args.replacement.length()) {
-                throw CLI::ValidationError("Error: for binary safety, the replacement pattern and "
-                                           "the "
-                                           "replacement string must be the same length.");
+                if (pattern.empty()) {
+                    throw CLI::ValidationError("Error: replacement pattern cannot be empty.");
+                }
+                if (pattern.length() != replacement.length()) {
+                    throw CLI::ValidationError(
+                        "Error: for binary safety, the replacement pattern and the replacement "
+                        "string must be the same length: "
+                        + pattern + " " + replacement);
+                }
+                pairs.push_back({pattern, replacement});
             }
+            args.replacer.compile(std::move(pairs));
         }
     });
 
@@ -86,291 +607,2599 @@ std::optional<CommandLineArgs> parseCommandLine(int argc, char** argv)
     return args;
 }
 
-// Generates a random alphanumeric string of a given length.
-std::string generateRandomString(size_t length)
+// Names processed and heap allocations made in the per-name loops, the generated names that had
+// to be regenerated because they were taken, and the category names resolved through
+// __objc_catlist (whether or not another section had them already) and through chained fixups
+// in particular, reported by --stats.
+struct HotLoopStatistics
 {
-    constexpr std::string_view charset = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234"
-                                         "56789";
-    static std::mt19937        generator(std::random_device {}());
-    std::uniform_int_distribution<int> distribution(0, charset.length() - 1);
-    std::string                        random_string;
-    for (size_t i = 0; i < length; ++i) {
-        random_string += charset[distribution(generator)];
+    uint64_t Names             = 0;
+    uint64_t Allocations       = 0;
+    uint64_t Collisions        = 0;
+    uint64_t Retries           = 0;
+    uint64_t Categories        = 0;
+    uint64_t FixedUpCategories = 0;
+};
+HotLoopStatistics HotLoopStats;
+
+// Adds the heap allocations made during its lifetime to HotLoopStats.
+class AllocationScope
+{
+public:
+    AllocationScope() :
+        Start(HeapAllocations)
+    {}
+    ~AllocationScope()
+    {
+        HotLoopStats.Allocations += HeapAllocations - Start;
     }
-    return random_string;
-}
 
-// Converts a virtual address (VA) to a file offset relative to the start of the Mach-O slice.
-std::optional<uint64_t> virtualAddressToFileOffset(const MachOObjectFile* Obj, uint64_t VA)
+private:
+    uint64_t Start;
+};
+
+// Fills Name with alphanumeric characters that only depend on Key, the original name and Attempt;
+// like a random name, it starts with a letter. Each SipHash of the original name yields ten
+// characters; further hashes use a key tweaked by their index, so names of any length are
+// covered. Another Attempt, after a collision, tweaks the other half of the key.
+void fillKeyedName(MutableArrayRef<char> Name,
+                   StringRef             Original,
+                   const HashKey&        Key,
+                   uint64_t              Attempt = 0)
 {
-    for (const auto& LCI : Obj->load_commands()) {
-        if (LCI.C.cmd == MachO::LC_SEGMENT_64) {
-            const MachO::segment_command_64 Seg = Obj->getSegment64LoadCommand(LCI);
-            if (VA >= Seg.vmaddr && VA < (Seg.vmaddr + Seg.vmsize)) {
-                return (VA - Seg.vmaddr) + Seg.fileoff;
-            }
-        } else if (LCI.C.cmd == MachO::LC_SEGMENT) {
-            const MachO::segment_command Seg = Obj->getSegmentLoadCommand(LCI);
-            if (VA >= Seg.vmaddr && VA < (Seg.vmaddr + Seg.vmsize)) {
-                return (VA - Seg.vmaddr) + Seg.fileoff;
-            }
+    constexpr unsigned CharsPerHash = 10; // 62^10 < 2^64
+    for (size_t Pos = 0, Block = 0; Pos < Name.size(); ++Block) {
+        uint64_t Hash = sipHash24({Key[0] ^ Attempt, Key[1] ^ Block}, Original);
+        for (unsigned Char = 0; Char < CharsPerHash && Pos < Name.size(); ++Char) {
+            const size_t Base = Pos == 0 ? NameLetters : NameCharset.size();
+            Name[Pos++]       = NameCharset[Hash % Base];
+            Hash /= Base;
         }
     }
-    return std::nullopt;
 }
 
-// Patches the __objc_classname section, skipping any names in the excluded list.
-// Now accepts the CommandLineArgs struct.
-void patchClassNameSection(const SectionRef&      Section,
-                           const MachOObjectFile* MachOObj,
-                           WritableMemoryBuffer&  WritableMB,
-                           uint64_t               SliceOffset,
-                           const CommandLineArgs& args)
+// Why a range of the file was patched; stored in exported patch plans.
+enum class PatchReason : uint8_t
 {
-    uint64_t SectionFileOffset = 0;
-    if (MachOObj->is64Bit()) {
-        const MachO::section_64 Sec = MachOObj->getSection64(Section.getRawDataRefImpl());
-        SectionFileOffset           = Sec.offset;
-    } else {
-        const MachO::section Sec = MachOObj->getSection(Section.getRawDataRefImpl());
-        SectionFileOffset        = Sec.offset;
-    }
+    ClassName    = 1,
+    CategoryName = 2,
+};
 
-    Expected<StringRef> ContentsOrErr = Section.getContents();
-    if (auto E = ContentsOrErr.takeError()) {
-        consumeError(std::move(E));
-        return;
-    }
-    StringRef   Contents = *ContentsOrErr;
-    const char* Current  = Contents.begin();
-    while (Current < Contents.end()) {
-        StringRef Name(Current);
-        if (Name.empty()) {
-            Current++;
-            continue;
-        }
+StringRef patchReasonTag(PatchReason Reason)
+{
+    return Reason == PatchReason::CategoryName ? "[CATEGORY]" : "[CLASS]";
+}
 
-        if (args.excludedClasses.count(Name.str())) {
-            if (!args.quietMode)
-                outs() << "[CLASS] Skipping excluded class: " << Name.str() << "\n";
-            Current += Name.size() + 1;
-            continue;
+// Sparse set of patches on top of the unmodified input: a sorted list of patched file ranges, each
+// holding its new bytes. Overlapping and adjacent patches are coalesced on insertion, so the list
+// stays as short as possible for the writeback. Nothing is copied from the input; the patches are
+// only materialized when the output is written. Names reachable from several sections (e.g.
+// category names, which also live in __objc_classname) are only patched by the first pass that
+// sees them.
+//
+// The new bytes of all ranges live in one arena. Writes usually arrive in file order and then
+// only append to the arena and the range list, so after reserve() a write does not allocate.
+class PatchOverlay
+{
+public:
+    // One write to the overlay, in the order the writes happened.
+    struct Record
+    {
+        uint64_t    FileOffset;
+        uint32_t    Size;
+        PatchReason Reason;
+    };
+
+    // A patched range of the file; its new bytes are at ArenaOffset in the arena.
+    struct Range
+    {
+        uint64_t Begin;
+        uint64_t Size;
+        uint64_t ArenaOffset;
+
+        uint64_t end() const
+        {
+            return Begin + Size;
         }
+    };
 
-        uint64_t RealFileOffset = SliceOffset + SectionFileOffset + (Current - Contents.begin());
-        bool     useReplaceMode = !args.pattern.empty();
+    void reserve(size_t NumWrites, size_t NumBytes)
+    {
+        Records.reserve(Records.size() + NumWrites);
+        Ranges.reserve(Ranges.size() + NumWrites);
+        Arena.reserve(Arena.size() + NumBytes);
+    }
 
-        if (useReplaceMode) {
-            std::string originalName = Name.str();
-            std::string newName      = originalName;
-            size_t      pos          = 0;
-            bool        replaced     = false;
-            while ((pos = newName.find(args.pattern, pos)) != std::string::npos) {
-                newName.replace(pos, args.pattern.length(), args.replacement);
-                pos += args.replacement.length();
-                replaced = true;
-            }
+    // Patches Size bytes at FileOffset and returns the buffer the caller fills with the new bytes.
+    MutableArrayRef<char> write(uint64_t FileOffset, size_t Size, PatchReason Reason)
+    {
+        if (Size == 0)
+            return {};
+        Records.push_back({FileOffset, static_cast<uint32_t>(Size), Reason});
+        uint64_t Begin = FileOffset;
+        uint64_t End   = FileOffset + Size;
 
-            if (replaced) {
-                if (!args.quietMode) {
-                    outs() << "[CLASS] Found: " << originalName << " at file offset "
-                           << RealFileOffset << "\n"
-                           << "  -> Replaced with: " << newName << "\n";
-                }
-                char* PatchLocation = WritableMB.getBufferStart() + RealFileOffset;
-                memcpy(PatchLocation, newName.c_str(), originalName.length());
-            }
-        } else { // Randomization mode
-            if (!args.quietMode)
-                outs() << "[CLASS] Found: " << Name.str() << " at file offset " << RealFileOffset
-                       << "\n";
+        // Find all ranges that overlap or touch the new one; together they form one range.
+        auto First = llvm::upper_bound(
+            Ranges, Begin, [](uint64_t Offset, const Range& R) { return Offset < R.Begin; });
+        if (First != Ranges.begin() && std::prev(First)->end() >= Begin)
+            --First;
+        auto Last = First;
+        while (Last != Ranges.end() && Last->Begin <= End) {
+            Begin = std::min(Begin, Last->Begin);
+            End   = std::max(End, Last->end());
+            ++Last;
+        }
 
-            std::string RandomString  = generateRandomString(Name.size());
-            char*       PatchLocation = WritableMB.getBufferStart() + RealFileOffset;
-            memcpy(PatchLocation, RandomString.c_str(), RandomString.length());
-            if (!args.quietMode)
-                outs() << "  -> Replaced with: " << RandomString << "\n";
+        // Extending the last range whose bytes end the arena just appends to the arena.
+        if (First != Last && std::next(First) == Last && First->Begin == Begin
+            && First->end() == FileOffset && First->ArenaOffset + First->Size == Arena.size()) {
+            Arena.resize(Arena.size() + Size);
+            First->Size = End - Begin;
+            return MutableArrayRef<char>(Arena).take_back(Size);
         }
 
-        Current += Name.size() + 1;
+        // Otherwise the merged range gets fresh space at the end of the arena.
+        const uint64_t ArenaOffset = Arena.size();
+        Arena.resize(ArenaOffset + (End - Begin));
+        for (auto It = First; It != Last; ++It)
+            memcpy(Arena.data() + ArenaOffset + (It->Begin - Begin),
+                   Arena.data() + It->ArenaOffset,
+                   It->Size);
+        auto Insert = Ranges.erase(First, Last);
+        Ranges.insert(Insert, {Begin, End - Begin, ArenaOffset});
+        return MutableArrayRef<char>(Arena).slice(ArenaOffset + (FileOffset - Begin), Size);
     }
-}
 
-// Patches the names pointed to by the __objc_catlist section.
-// Now accepts the CommandLineArgs struct.
-void patchCategoryListSection(const SectionRef&      Section,
-                              const MachOObjectFile* MachOObj,
-                              const MemoryBuffer&    OriginalMB,
-                              WritableMemoryBuffer&  WritableMB,
-                              uint64_t               SliceOffset,
-                              const CommandLineArgs& args)
-{
-    Expected<StringRef> ContentsOrErr = Section.getContents();
-    if (auto E = ContentsOrErr.takeError()) {
-        consumeError(std::move(E));
-        return;
+    void write(uint64_t FileOffset, StringRef NewBytes, PatchReason Reason)
+    {
+        MutableArrayRef<char> Dest = write(FileOffset, NewBytes.size(), Reason);
+        if (!Dest.empty())
+            memcpy(Dest.data(), NewBytes.data(), NewBytes.size());
     }
-    StringRef   Contents = *ContentsOrErr;
-    const char* Data     = Contents.data();
-    unsigned    PtrSize  = MachOObj->is64Bit() ? 8 : 4;
 
-    for (unsigned i = 0; i + PtrSize <= Contents.size(); i += PtrSize) {
-        uint64_t category_va         = (PtrSize == 8) ? *(const uint64_t*)(Data + i)
-                                                      : *(const uint32_t*)(Data + i);
-        auto     category_offset_opt = virtualAddressToFileOffset(MachOObj, category_va);
-        if (!category_offset_opt)
-            continue;
+    bool isPatched(uint64_t FileOffset) const
+    {
+        const Range* R = findRange(FileOffset);
+        return R && FileOffset < R->end();
+    }
 
-        const char* CategoryStructPtr
-            = OriginalMB.getBufferStart() + SliceOffset + *category_offset_opt;
-        uint64_t category_name_va = (PtrSize == 8) ? *(const uint64_t*)CategoryStructPtr
-                                                   : *(const uint32_t*)CategoryStructPtr;
+    // The patched bytes of a range that was written as a whole earlier, e.g. a Record.
+    StringRef patchedBytes(uint64_t FileOffset, size_t Size) const
+    {
+        const Range* R = findRange(FileOffset);
+        return bytes(*R).substr(FileOffset - R->Begin, Size);
+    }
 
-        auto name_offset_opt = virtualAddressToFileOffset(MachOObj, category_name_va);
-        if (!name_offset_opt)
-            continue;
+    // The new bytes of one of the ranges.
+    StringRef bytes(const Range& R) const
+    {
+        return StringRef(Arena.data() + R.ArenaOffset, R.Size);
+    }
 
-        uint64_t  RealNameOffset = SliceOffset + *name_offset_opt;
-        StringRef CategoryName(OriginalMB.getBufferStart() + RealNameOffset);
-        if (CategoryName.empty())
-            continue;
+    ArrayRef<Record> records() const
+    {
+        return Records;
+    }
 
-        bool useReplaceMode = !args.pattern.empty();
-
-        if (useReplaceMode) {
-            std::string originalName = CategoryName.str();
-            std::string newName      = originalName;
-            size_t      pos          = 0;
-            bool        replaced     = false;
-            while ((pos = newName.find(args.pattern, pos)) != std::string::npos) {
-                newName.replace(pos, args.pattern.length(), args.replacement);
-                pos += args.replacement.length();
-                replaced = true;
-            }
+    // Copies the patches that fall into Dest, a view of the file starting at file offset
+    // DestOffset, over its contents.
+    void applyTo(MutableArrayRef<char> Dest, uint64_t DestOffset = 0) const
+    {
+        const uint64_t DestEnd = DestOffset + Dest.size();
+        auto           It      = llvm::upper_bound(
+            Ranges, DestOffset, [](uint64_t Offset, const Range& R) { return Offset < R.Begin; });
+        if (It != Ranges.begin())
+            --It;
+        for (; It != Ranges.end() && It->Begin < DestEnd; ++It) {
+            uint64_t Begin = std::max(It->Begin, DestOffset);
+            uint64_t End   = std::min(It->end(), DestEnd);
+            if (Begin < End)
+                memcpy(Dest.data() + (Begin - DestOffset),
+                       Arena.data() + It->ArenaOffset + (Begin - It->Begin),
+                       End - Begin);
+        }
+    }
 
-            if (replaced) {
-                if (!args.quietMode) {
-                    outs() << "[CATEGORY] Found: " << originalName << " at file offset "
-                           << RealNameOffset << "\n"
-                           << "  -> Replaced with: " << newName << "\n";
-                }
-                char* PatchLocation = WritableMB.getBufferStart() + RealNameOffset;
-                memcpy(PatchLocation, newName.c_str(), originalName.length());
-            }
-        } else { // Randomization mode
-            if (!args.quietMode)
-                outs() << "[CATEGORY] Found: " << CategoryName.str() << " at file offset "
-                       << RealNameOffset << "\n";
+    size_t size() const
+    {
+        return Ranges.size();
+    }
 
-            std::string RandomString  = generateRandomString(CategoryName.size());
-            char*       PatchLocation = WritableMB.getBufferStart() + RealNameOffset;
-            memcpy(PatchLocation, RandomString.c_str(), RandomString.length());
+    uint64_t totalBytes() const
+    {
+        uint64_t Total = 0;
+        for (const Range& R : Ranges)
+            Total += R.Size;
+        return Total;
+    }
 
-            if (!args.quietMode)
-                outs() << "  -> Replaced with: " << RandomString << "\n";
-        }
+    auto begin() const
+    {
+        return Ranges.begin();
+    }
+    auto end() const
+    {
+        return Ranges.end();
     }
-}
 
-// Processes a single Mach-O binary slice.
-// Now accepts the CommandLineArgs struct.
-Error patchMachOSlice(MachOObjectFile*       MachOObj,
-                      const MemoryBuffer&    OriginalMB,
-                      WritableMemoryBuffer&  WritableMB,
-                      uint64_t               SliceOffset,
-                      const CommandLineArgs& args)
-{
-    if (!args.quietMode) {
-        outs() << "--- Patching architecture: " << MachOObj->getArchTriple().getArchName()
-               << " (slice offset: " << SliceOffset << ") ---\n";
+private:
+    // The last range starting at or before FileOffset, if any.
+    const Range* findRange(uint64_t FileOffset) const
+    {
+        auto It = llvm::upper_bound(
+            Ranges, FileOffset, [](uint64_t Offset, const Range& R) { return Offset < R.Begin; });
+        return It == Ranges.begin() ? nullptr : &*std::prev(It);
     }
-    for (const SectionRef& Section : MachOObj->sections()) {
-        Expected<StringRef> SectionNameOrErr = Section.getName();
-        if (auto E = SectionNameOrErr.takeError()) {
-            return E;
-        }
-        StringRef SectionName = *SectionNameOrErr;
 
-        if (SectionName == "__objc_classname") {
-            patchClassNameSection(Section, MachOObj, WritableMB, SliceOffset, args);
-        } else if (SectionName == "__objc_catlist") {
-            patchCategoryListSection(Section, MachOObj, OriginalMB, WritableMB, SliceOffset, args);
+    std::vector<Range>  Ranges; // Sorted by Begin
+    std::vector<char>   Arena;
+    std::vector<Record> Records;
+};
+
+// Writes the patches into the existing file FD, each at its own offset. Nothing outside the patched
+// ranges is touched.
+Error writePatches(int FD, const PatchOverlay& Overlay)
+{
+    for (const PatchOverlay::Range& R : Overlay) {
+        StringRef Bytes = Overlay.bytes(R);
+        for (size_t Done = 0; Done < Bytes.size();) {
+            ssize_t Written = sys::RetryAfterSignal(
+                -1, ::pwrite, FD, Bytes.data() + Done, Bytes.size() - Done, R.Begin + Done);
+            if (Written < 0)
+                return errorCodeToError(std::error_code(errno, std::generic_category()));
+            Done += Written;
         }
     }
     return Error::success();
 }
 
-} // namespace
-
-int main(int argc, char** argv)
+// Calls Callback(Cmd, Bytes) for every load command of the Mach-O image in Slice, straight from
+// the raw header and without building a MachOObjectFile. Returns false if Slice is not a Mach-O
+// image or its load commands are malformed.
+template <typename CallbackT>
+bool forEachLoadCommand(StringRef Slice, CallbackT&& Callback)
 {
-    // All command line parsing is now handled in this function.
-    auto argsOpt = parseCommandLine(argc, argv);
-    if (!argsOpt) {
-        // Error message or help text was already printed by the parser.
-        return 1;
-    }
-    // Use the returned struct for all arguments.
-    const auto& args = *argsOpt;
+    if (Slice.size() < sizeof(MachO::mach_header))
+        return false;
+    const uint32_t Magic     = support::endian::read32le(Slice.data());
+    const bool     BigEndian = Magic == MachO::MH_CIGAM || Magic == MachO::MH_CIGAM_64;
+    const bool     Is64      = Magic == MachO::MH_MAGIC_64 || Magic == MachO::MH_CIGAM_64;
+    if (!BigEndian && Magic != MachO::MH_MAGIC && Magic != MachO::MH_MAGIC_64)
+        return false;
+    auto read32 = [&](const char* P) {
+        return BigEndian ? support::endian::read32be(P) : support::endian::read32le(P);
+    };
 
-    Expected<OwningBinary<Binary>> BinOrErr = createBinary(args.binaryPath);
-    if (auto E = BinOrErr.takeError()) {
-        errs() << "Error opening binary: " << toString(std::move(E)) << "\n";
-        return 1;
+    const uint32_t NumCommands = read32(Slice.data() + offsetof(MachO::mach_header, ncmds));
+    uint64_t       Offset = Is64 ? sizeof(MachO::mach_header_64) : sizeof(MachO::mach_header);
+    for (uint32_t Index = 0; Index < NumCommands; ++Index) {
+        if (Offset + sizeof(MachO::load_command) > Slice.size())
+            return false;
+        const uint32_t Cmd  = read32(Slice.data() + Offset);
+        const uint32_t Size = read32(Slice.data() + Offset + 4);
+        if (Size < sizeof(MachO::load_command) || Offset + Size > Slice.size())
+            return false;
+        Callback(Cmd, Slice.substr(Offset, Size));
+        Offset += Size;
     }
-    OwningBinary<Binary>& Bin = BinOrErr.get();
+    return true;
+}
 
-    ErrorOr<std::unique_ptr<MemoryBuffer>> MBOrErr = MemoryBuffer::getFile(args.binaryPath);
-    if (std::error_code EC = MBOrErr.getError()) {
-        errs() << "Error reading file into buffer: " << EC.message() << "\n";
-        return 1;
-    }
-    std::unique_ptr<MemoryBuffer>         OriginalMB {std::move(MBOrErr.get())};
-    std::unique_ptr<WritableMemoryBuffer> WritableMB
-        = WritableMemoryBuffer::getNewMemBuffer(OriginalMB->getBufferSize());
-    memcpy(WritableMB->getBufferStart(), OriginalMB->getBufferStart(), OriginalMB->getBufferSize());
+using SliceUUID = std::array<uint8_t, 16>;
 
-    if (auto* MachOUni = dyn_cast<MachOUniversalBinary>(Bin.getBinary())) {
-        for (const auto& ObjForArch : MachOUni->objects()) {
-            Expected<std::unique_ptr<MachOObjectFile>> MachOObjOrErr = ObjForArch.getAsObjectFile();
-            if (auto E = MachOObjOrErr.takeError()) {
-                errs() << "Failed to get object for architecture: " << toString(std::move(E))
-                       << "\n";
-                continue;
-            }
-            if (auto E = patchMachOSlice(
-                    MachOObjOrErr->get(), *OriginalMB, *WritableMB, ObjForArch.getOffset(), args)) {
-                errs() << "Failed to patch Mach-O slice: " << toString(std::move(E)) << "\n";
+// The LC_UUID of the Mach-O image in Slice, or all zeroes if it has none.
+SliceUUID readSliceUUID(StringRef Slice)
+{
+    SliceUUID UUID {};
+    forEachLoadCommand(Slice, [&](uint32_t Cmd, StringRef Bytes) {
+        if (Cmd == MachO::LC_UUID && Bytes.size() >= sizeof(MachO::uuid_command))
+            memcpy(UUID.data(), Bytes.data() + offsetof(MachO::uuid_command, uuid), UUID.size());
+    });
+    return UUID;
+}
+
+// Returns the name of an architecture as used by lipo, e.g. arm64 or x86_64.
+std::string archFlagName(uint32_t CPUType, uint32_t CPUSubType)
+{
+    const char* ArchFlag = nullptr;
+    MachOObjectFile::getArchTriple(CPUType, CPUSubType, nullptr, &ArchFlag);
+    return ArchFlag ? ArchFlag : "unknown";
+}
+
+// Whether the slice with the given architecture and contents is selected by --arch and
+// --platform. The platform is read from LC_BUILD_VERSION, or from the older LC_VERSION_MIN_*
+// commands, straight from the header, so a slice that is not selected is never parsed.
+bool isSliceSelected(StringRef ArchName, StringRef Slice, const CommandLineArgs& args)
+{
+    if (!args.archs.empty() && args.archs.count(ArchName.str()) == 0)
+        return false;
+    if (args.platforms.empty())
+        return true;
+
+    bool Selected = false;
+    forEachLoadCommand(Slice, [&](uint32_t Cmd, StringRef Bytes) {
+        uint32_t Platform = 0;
+        switch (Cmd) {
+        case MachO::LC_BUILD_VERSION:
+            if (Bytes.size() >= sizeof(MachO::build_version_command))
+                Platform = support::endian::read32le(
+                    Bytes.data() + offsetof(MachO::build_version_command, platform));
+            break;
+        case MachO::LC_VERSION_MIN_MACOSX:
+            Platform = MachO::PLATFORM_MACOS;
+            break;
+        case MachO::LC_VERSION_MIN_IPHONEOS:
+            Platform = MachO::PLATFORM_IOS;
+            break;
+        case MachO::LC_VERSION_MIN_TVOS:
+            Platform = MachO::PLATFORM_TVOS;
+            break;
+        case MachO::LC_VERSION_MIN_WATCHOS:
+            Platform = MachO::PLATFORM_WATCHOS;
+            break;
+        }
+        Selected |= Platform != 0 && args.platforms.count(Platform) != 0;
+    });
+    return Selected;
+}
+
+// Translates virtual addresses (VA) to file offsets relative to the start of a Mach-O slice. The
+// segments are sorted by address once, so a lookup is a binary search; the segment of the previous
+// hit is tried first, as consecutive lookups usually land in the same segment.
+class SegmentTable
+{
+public:
+    explicit SegmentTable(const MachOObjectFile* Obj)
+    {
+        for (const auto& LCI : Obj->load_commands()) {
+            if (LCI.C.cmd == MachO::LC_SEGMENT_64) {
+                const MachO::segment_command_64 Seg = Obj->getSegment64LoadCommand(LCI);
+                add(Seg.vmaddr, Seg.vmsize, Seg.fileoff);
+            } else if (LCI.C.cmd == MachO::LC_SEGMENT) {
+                const MachO::segment_command Seg = Obj->getSegmentLoadCommand(LCI);
+                add(Seg.vmaddr, Seg.vmsize, Seg.fileoff);
             }
         }
-    } else if (auto* MachOObj = dyn_cast<MachOObjectFile>(Bin.getBinary())) {
-        if (auto E = patchMachOSlice(MachOObj, *OriginalMB, *WritableMB, 0, args)) {
-            errs() << "Failed to patch Mach-O file: " << toString(std::move(E)) << "\n";
-            return 1;
+
+        // Linkers never emit overlapping segments. Should a crafted binary contain them anyway,
+        // keep the load command order so that the first matching segment wins.
+        llvm::sort(Segments,
+                   [](const Segment& A, const Segment& B) { return A.VMAddr < B.VMAddr; });
+        for (size_t Index = 1; Index < Segments.size(); ++Index) {
+            if (Segments[Index].VMAddr - Segments[Index - 1].VMAddr < Segments[Index - 1].VMSize) {
+                llvm::sort(Segments,
+                           [](const Segment& A, const Segment& B) { return A.Order < B.Order; });
+                Sorted = false;
+                break;
+            }
         }
-    } else {
-        errs() << "The provided file is not a valid Mach-O binary.\n";
-        return 1;
     }
 
-    if (args.dryRun) {
-        if (!args.quietMode)
-            outs() << "\nDry run complete. Binary was not modified.\n";
-        return 0;
+    std::optional<uint64_t> toFileOffset(uint64_t VA) const
+    {
+        if (LastHit && LastHit->contains(VA))
+            return LastHit->toFileOffset(VA);
+
+        const Segment* Match = nullptr;
+        if (Sorted) {
+            auto It = llvm::upper_bound(
+                Segments, VA, [](uint64_t Addr, const Segment& Seg) { return Addr < Seg.VMAddr; });
+            if (It != Segments.begin() && std::prev(It)->contains(VA))
+                Match = &*std::prev(It);
+        } else {
+            auto It = llvm::find_if(Segments, [&](const Segment& Seg) { return Seg.contains(VA); });
+            if (It != Segments.end())
+                Match = &*It;
+        }
+        if (!Match)
+            return std::nullopt;
+        if (Sorted)
+            LastHit = Match;
+        return Match->toFileOffset(VA);
     }
 
-    // Overwrite the original file with the modified buffer.
-    std::error_code EC;
-    raw_fd_ostream  OutFile(args.binaryPath, EC);
-    if (EC) {
-        errs() << "Error opening file for writing: " << EC.message() << "\n";
-        return 1;
+private:
+    struct Segment
+    {
+        uint64_t VMAddr;
+        uint64_t VMSize;
+        uint64_t FileOff;
+        unsigned Order;
+
+        bool contains(uint64_t VA) const
+        {
+            return VA >= VMAddr && VA - VMAddr < VMSize;
+        }
+
+        uint64_t toFileOffset(uint64_t VA) const
+        {
+            return (VA - VMAddr) + FileOff;
+        }
+    };
+
+    void add(uint64_t VMAddr, uint64_t VMSize, uint64_t FileOff)
+    {
+        if (VMSize != 0)
+            Segments.push_back({VMAddr, VMSize, FileOff, unsigned(Segments.size())});
     }
-    OutFile.write(WritableMB->getBufferStart(), WritableMB->getBufferSize());
-    OutFile.close();
 
-    if (!args.quietMode)
-        outs() << "\nSuccessfully patched binary in-place: " << args.binaryPath << "\n";
+    SmallVector<Segment, 8> Segments;
+    bool                    Sorted  = true;
+    mutable const Segment*  LastHit = nullptr;
+};
+
+// Pointer formats of LC_DYLD_CHAINED_FIXUPS, as defined in <mach-o/fixup-chains.h>.
+enum ChainedPointerFormat : uint16_t
+{
+    ChainedPtrArm64e           = 1,
+    ChainedPtr64               = 2,
+    ChainedPtr32               = 3,
+    ChainedPtr64Offset         = 6,
+    ChainedPtrArm64eUserland   = 9,
+    ChainedPtrArm64eUserland24 = 12,
+};
+
+constexpr uint16_t ChainedPtrStartNone  = 0xFFFF;
+constexpr uint16_t ChainedPtrStartMulti = 0x8000;
+constexpr uint16_t ChainedPtrStartLast  = 0x8000;
+
+// Maps the file offset (relative to the slice) of every rebased pointer to its target address.
+using ChainedFixupTable = DenseMap<uint64_t, uint64_t>;
+
+// Decodes the fixup chains of a slice linked with LC_DYLD_CHAINED_FIXUPS. In such binaries the
+// pointers on disk are chain entries rather than addresses; every chain is walked once here, so
+// resolving a pointer later is a single table lookup. Binds are not recorded, as they point
+// outside of the image. Leaves Table empty if the slice has no chained fixups.
+Error decodeChainedFixups(const MachOObjectFile* Obj, ChainedFixupTable& Table)
+{
+    struct Segment
+    {
+        uint64_t VMAddr;
+        uint64_t FileOff;
+        uint64_t FileSize;
+    };
+    std::optional<MachO::linkedit_data_command> FixupsCmd;
+    SmallVector<Segment, 8>                     Segments;
+    for (const auto& LCI : Obj->load_commands()) {
+        if (LCI.C.cmd == MachO::LC_DYLD_CHAINED_FIXUPS) {
+            FixupsCmd = Obj->getLinkeditDataLoadCommand(LCI);
+        } else if (LCI.C.cmd == MachO::LC_SEGMENT_64) {
+            const MachO::segment_command_64 Seg = Obj->getSegment64LoadCommand(LCI);
+            Segments.push_back({Seg.vmaddr, Seg.fileoff, Seg.filesize});
+        } else if (LCI.C.cmd == MachO::LC_SEGMENT) {
+            const MachO::segment_command Seg = Obj->getSegmentLoadCommand(LCI);
+            Segments.push_back({Seg.vmaddr, Seg.fileoff, Seg.filesize});
+        }
+    }
+    if (!FixupsCmd)
+        return Error::success();
+
+    // Targets given as offsets are relative to the preferred load address, i.e. that of __TEXT.
+    uint64_t ImageBase = 0;
+    for (const Segment& Seg : Segments) {
+        if (Seg.FileOff == 0 && Seg.FileSize != 0) {
+            ImageBase = Seg.VMAddr;
+            break;
+        }
+    }
+
+    StringRef SliceContents = Obj->getData();
+    if (FixupsCmd->dataoff > SliceContents.size()
+        || FixupsCmd->datasize > SliceContents.size() - FixupsCmd->dataoff)
+        return createStringError(std::errc::invalid_argument,
+                                 "chained fixups extend past the end of the slice");
+    DataExtractor Data(SliceContents.substr(FixupsCmd->dataoff, FixupsCmd->datasize),
+                       /*IsLittleEndian=*/true,
+                       /*AddressSize=*/8);
+    // dyld_chained_fixups_header, followed by dyld_chained_starts_in_image at starts_offset.
+    DataExtractor::Cursor C(sizeof(uint32_t));
+    const uint64_t        StartsOffset = Data.getU32(C);
+    C.seek(StartsOffset);
+    const uint32_t SegCount = Data.getU32(C);
+    if (!C)
+        return C.takeError();
+
+    for (uint32_t SegIndex = 0; SegIndex < SegCount && SegIndex < Segments.size(); ++SegIndex) {
+        uint64_t       InfoOffset = StartsOffset + sizeof(uint32_t) + SegIndex * sizeof(uint32_t);
+        const uint32_t SegOffset  = Data.getU32(&InfoOffset);
+        if (SegOffset == 0)
+            continue;
+
+        // dyld_chained_starts_in_segment
+        DataExtractor::Cursor Starts(StartsOffset + SegOffset + sizeof(uint32_t));
+        const uint16_t        PageSize  = Data.getU16(Starts);
+        const uint16_t        Format    = Data.getU16(Starts);
+        Data.skip(Starts, sizeof(uint64_t)); // segment_offset
+        const uint32_t MaxValidPointer = Data.getU32(Starts);
+        const uint16_t PageCount       = Data.getU16(Starts);
+        const uint64_t PageStarts      = Starts.tell();
+        if (!Starts)
+            return Starts.takeError();
+        if (!Data.isValidOffsetForDataOfSize(PageStarts, PageCount * sizeof(uint16_t)))
+            return createStringError(std::errc::invalid_argument,
+                                     "chained fixup page starts extend past the fixup data");
+
+        unsigned Stride;
+        switch (Format) {
+        case ChainedPtrArm64e:
+        case ChainedPtrArm64eUserland:
+        case ChainedPtrArm64eUserland24:
+            Stride = 8;
+            break;
+        case ChainedPtr64:
+        case ChainedPtr64Offset:
+        case ChainedPtr32:
+            Stride = 4;
+            break;
+        default:
+            return createStringError(std::errc::not_supported,
+                                     "unsupported chained pointer format %u",
+                                     Format);
+        }
+
+        // Walks one chain, starting at the given file offset.
+        auto walkChain = [&](uint64_t Offset) -> Error {
+            while (true) {
+                const unsigned Size = Format == ChainedPtr32 ? 4 : 8;
+                if (Offset + Size > SliceContents.size())
+                    return createStringError(std::errc::invalid_argument,
+                                             "fixup chain leaves the slice at offset %" PRIu64,
+                                             Offset);
+                const char* Ptr = SliceContents.data() + Offset;
+                uint64_t    Next;
+                if (Format == ChainedPtr32) {
+                    const uint32_t Raw    = support::endian::read32le(Ptr);
+                    const uint32_t Target = Raw & 0x3FFFFFF;
+                    Next                  = (Raw >> 26) & 0x1F;
+                    // Targets above MaxValidPointer encode plain integers, not addresses.
+                    if (!(Raw >> 31) && Target <= MaxValidPointer)
+                        Table[Offset] = Target;
+                } else if (Stride == 8) {
+                    const uint64_t Raw  = support::endian::read64le(Ptr);
+                    const bool     Bind = (Raw >> 62) & 1;
+                    const bool     Auth = (Raw >> 63) & 1;
+                    Next                = (Raw >> 51) & 0x7FF;
+                    if (Auth && !Bind)
+                        Table[Offset] = ImageBase + (Raw & 0xFFFFFFFF);
+                    else if (!Bind)
+                        Table[Offset] = (Raw & 0x7FFFFFFFFFF)
+                                        + (Format == ChainedPtrArm64e ? 0 : ImageBase);
+                } else {
+                    const uint64_t Raw = support::endian::read64le(Ptr);
+                    Next               = (Raw >> 51) & 0xFFF;
+                    if (!(Raw >> 63))
+                        Table[Offset] = (Raw & 0xFFFFFFFFF)
+                                        + (Format == ChainedPtr64Offset ? ImageBase : 0);
+                }
+                if (Next == 0)
+                    return Error::success();
+                Offset += Next * Stride;
+            }
+        };
+
+        const uint64_t SegFileOffset = Segments[SegIndex].FileOff;
+        for (uint16_t Page = 0; Page < PageCount; ++Page) {
+            uint64_t StartOffset = PageStarts + Page * sizeof(uint16_t);
+            uint16_t Start       = Data.getU16(&StartOffset);
+            if (Start == ChainedPtrStartNone)
+                continue;
+            const uint64_t PageOffset = SegFileOffset + uint64_t(Page) * PageSize;
+
+            // 32-bit pages may hold several chains, listed after the page starts.
+            if (Format == ChainedPtr32 && (Start & ChainedPtrStartMulti)) {
+                DataExtractor::Cursor Chains(PageStarts
+                                             + (Start & ~ChainedPtrStartMulti) * sizeof(uint16_t));
+                do {
+                    Start = Data.getU16(Chains);
+                    if (!Chains)
+                        return Chains.takeError();
+                    if (Error E = walkChain(PageOffset + (Start & ~ChainedPtrStartLast)))
+                        return E;
+                } while (!(Start & ChainedPtrStartLast));
+                continue;
+            }
+            if (Error E = walkChain(PageOffset + Start))
+                return E;
+        }
+    }
+    return Error::success();
+}
+
+// One Objective-C name found in a slice. Name views the bytes of the input.
+struct NameEntry
+{
+    uint64_t    FileOffset;
+    StringRef   Name;
+    PatchReason Reason;
+    bool        Excluded;
+};
+
+// The patchable names of one slice, in the order the sections were walked. The index is built
+// once per slice and can then be transformed as often as needed.
+struct SliceNames
+{
+    std::string            ArchName;
+    uint64_t               Offset;
+    uint64_t               Size;
+    SliceUUID              UUID;
+    std::vector<NameEntry> Names;
+};
+
+using NameIndex = std::vector<SliceNames>;
+
+// The file range of a section of a slice, as described by its header in the load commands.
+struct SectionInfo
+{
+    uint64_t Size;
+    uint64_t FileOffset;
+};
+
+// The sections of a slice that the indexers read, collected in one pass over the segment load
+// commands, so a slice with hundreds of sections is only scanned once.
+class SectionDirectory
+{
+public:
+    explicit SectionDirectory(const MachOObjectFile* Obj)
+    {
+        const uint64_t SliceSize = Obj->getData().size();
+        for (const auto& LCI : Obj->load_commands()) {
+            if (LCI.C.cmd == MachO::LC_SEGMENT_64) {
+                const MachO::segment_command_64 Seg = Obj->getSegment64LoadCommand(LCI);
+                for (uint32_t Index = 0; Index < Seg.nsects; ++Index) {
+                    const char* Header = LCI.Ptr + sizeof(MachO::segment_command_64)
+                                         + Index * sizeof(MachO::section_64);
+                    const MachO::section_64 Sec = Obj->getSection64(LCI, Index);
+                    add(Header, Sec.size, Sec.offset, Sec.flags, SliceSize);
+                }
+            } else if (LCI.C.cmd == MachO::LC_SEGMENT) {
+                const MachO::segment_command Seg = Obj->getSegmentLoadCommand(LCI);
+                for (uint32_t Index = 0; Index < Seg.nsects; ++Index) {
+                    const char* Header = LCI.Ptr + sizeof(MachO::segment_command)
+                                         + Index * sizeof(MachO::section);
+                    const MachO::section Sec = Obj->getSection(LCI, Index);
+                    add(Header, Sec.size, Sec.offset, Sec.flags, SliceSize);
+                }
+            }
+        }
+    }
+
+    // All __objc_classname sections, whichever segment they are in.
+    ArrayRef<SectionInfo> classNameSections() const
+    {
+        return ClassNameSections;
+    }
+
+    // All __objc_catlist sections, e.g. in __DATA or __DATA_CONST.
+    ArrayRef<SectionInfo> categoryListSections() const
+    {
+        return CategoryListSections;
+    }
+
+private:
+    // Header points to the section header; both of its names are fixed 16-byte fields at its
+    // start that are only NUL-terminated when shorter.
+    void add(const char* Header,
+             uint64_t    Size,
+             uint64_t    FileOffset,
+             uint32_t    Flags,
+             uint64_t    SliceSize)
+    {
+        const StringRef SectionName(Header, strnlen(Header, 16));
+        const StringRef SegmentName(Header + 16, strnlen(Header + 16, 16));
+        const StringRef Prefix = SegmentName.take_front(6);
+        if (Prefix != "__TEXT" && Prefix != "__DATA" && Prefix != "__AUTH" && Prefix != "__OBJC")
+            return;
+
+        const uint32_t Type = Flags & MachO::SECTION_TYPE;
+        if (Type == MachO::S_ZEROFILL || Type == MachO::S_GB_ZEROFILL
+            || Type == MachO::S_THREAD_LOCAL_ZEROFILL)
+            return;
+        if (FileOffset > SliceSize || Size > SliceSize - FileOffset)
+            return;
+
+        if (SectionName == "__objc_classname")
+            ClassNameSections.push_back({Size, FileOffset});
+        else if (SectionName == "__objc_catlist")
+            CategoryListSections.push_back({Size, FileOffset});
+    }
+
+    SmallVector<SectionInfo, 2> ClassNameSections;
+    SmallVector<SectionInfo, 2> CategoryListSections;
+};
+
+// Returns a mask with bit i set if Data[i] is Byte, for the 64 bytes starting at Data.
+uint64_t byteMask64(const char* Data, char Byte)
+{
+#if defined(__AVX2__)
+    const __m256i Needle = _mm256_set1_epi8(Byte);
+    const __m256i Lo     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Data));
+    const __m256i Hi     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Data + 32));
+    return uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(Lo, Needle))))
+           | uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(Hi, Needle)))) << 32;
+#elif defined(__SSE2__)
+    const __m128i Needle = _mm_set1_epi8(Byte);
+    uint64_t      Mask   = 0;
+    for (unsigned Chunk = 0; Chunk < 4; ++Chunk) {
+        const __m128i Bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + 16 * Chunk));
+        Mask |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(Bytes, Needle))))
+                << (16 * Chunk);
+    }
+    return Mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t Weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t     Weight      = vld1q_u8(Weights);
+    const uint8x16_t     Needle      = vdupq_n_u8(static_cast<uint8_t>(Byte));
+    uint64_t             Mask        = 0;
+    for (unsigned Chunk = 0; Chunk < 4; ++Chunk) {
+        const uint8x16_t Bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(Data + 16 * Chunk));
+        const uint8x16_t Bits  = vandq_u8(vceqq_u8(Bytes, Needle), Weight);
+        const uint64_t   Lo    = vaddv_u8(vget_low_u8(Bits));
+        const uint64_t   Hi    = vaddv_u8(vget_high_u8(Bits));
+        Mask |= (Lo | Hi << 8) << (16 * Chunk);
+    }
+    return Mask;
+#else
+    uint64_t Mask = 0;
+    for (unsigned Index = 0; Index < 64; ++Index)
+        Mask |= uint64_t(Data[Index] == Byte) << Index;
+    return Mask;
+#endif
+}
+
+// Offset and length of a NUL-terminated name within a section.
+struct NameSpan
+{
+    uint64_t Offset;
+    uint64_t Length;
+};
+
+// Splits Contents into its NUL-terminated names in a single pass, 64 bytes at a time. Runs of
+// NULs are skipped; a name that is not terminated before the end of Contents is dropped, so no
+// span ever reaches past the section.
+void scanNameSpans(StringRef Contents, SmallVectorImpl<NameSpan>& Spans)
+{
+    // Bit 0 of PrevNul tells whether the byte before the current block is a NUL; the start of the
+    // section counts as one.
+    uint64_t PrevNul = 1;
+    uint64_t Start   = 0;
+    for (uint64_t Block = 0; Block < Contents.size(); Block += 64) {
+        const uint64_t Remaining = Contents.size() - Block;
+        uint64_t       Nul;
+        uint64_t       Valid = ~uint64_t(0);
+        if (Remaining >= 64) {
+            Nul = byteMask64(Contents.data() + Block, 0);
+        } else {
+            char Tail[64] = {};
+            memcpy(Tail, Contents.data() + Block, Remaining);
+            Valid = (uint64_t(1) << Remaining) - 1;
+            Nul   = byteMask64(Tail, 0) & Valid;
+        }
+
+        // A name starts at a non-NUL byte that follows a NUL, and ends at a NUL that follows a
+        // non-NUL byte.
+        const uint64_t NulBefore = (Nul << 1) | PrevNul;
+        uint64_t       Starts    = ~Nul & NulBefore & Valid;
+        uint64_t       Ends      = Nul & ~NulBefore;
+        PrevNul                  = Nul >> 63;
+
+        while (Starts | Ends) {
+            const unsigned NextStart = Starts ? std::countr_zero(Starts) : 64;
+            const unsigned NextEnd   = Ends ? std::countr_zero(Ends) : 64;
+            if (NextStart < NextEnd) {
+                Start = Block + NextStart;
+                Starts &= Starts - 1;
+            } else {
+                Spans.push_back({Start, Block + NextEnd - Start});
+                Ends &= Ends - 1;
+            }
+        }
+    }
+}
+
+// Adds the names in a __objc_classname section to Slice, flagging those in the excluded list.
+void indexClassNameSection(const SectionInfo&     Section,
+                           StringRef              SliceContents,
+                           SliceNames&            Slice,
+                           DenseSet<uint64_t>&    Seen,
+                           const CommandLineArgs& args)
+{
+    StringRef                 Contents = SliceContents.substr(Section.FileOffset, Section.Size);
+    SmallVector<NameSpan, 64> Spans;
+    scanNameSpans(Contents, Spans);
+
+    Slice.Names.reserve(Slice.Names.size() + Spans.size());
+    Seen.reserve(Seen.size() + Spans.size());
+    AllocationScope Allocations;
+    for (const NameSpan& Span : Spans) {
+        StringRef Name           = Contents.substr(Span.Offset, Span.Length);
+        uint64_t  RealFileOffset = Slice.Offset + Section.FileOffset + Span.Offset;
+        if (Seen.insert(RealFileOffset).second) {
+            bool Excluded = args.excludedClasses.count(std::string_view(Name)) != 0;
+            Slice.Names.push_back({RealFileOffset, Name, PatchReason::ClassName, Excluded});
+        }
+    }
+}
+
+// Pointer width and byte order of a slice. The category indexer is instantiated for each layout
+// and the layout is picked once per slice, so reading a pointer neither branches on the format
+// nor relies on unaligned loads.
+template <unsigned PointerBytes, bool BigEndian>
+struct SliceLayout
+{
+    static constexpr unsigned PointerSize = PointerBytes;
+
+    // On-disk pointers may carry a top-byte tag; user space addresses never exceed 47 bits.
+    static constexpr uint64_t AddressMask = PointerBytes == 8 ? 0x00007FFFFFFFFFFF : 0xFFFFFFFF;
+
+    static uint64_t readPointer(const char* Ptr)
+    {
+        if constexpr (PointerBytes == 8)
+            return BigEndian ? support::endian::read64be(Ptr) : support::endian::read64le(Ptr);
+        else
+            return BigEndian ? support::endian::read32be(Ptr) : support::endian::read32le(Ptr);
+    }
+};
+
+using Layout64LE = SliceLayout<8, false>;
+using Layout32LE = SliceLayout<4, false>;
+using Layout64BE = SliceLayout<8, true>;
+using Layout32BE = SliceLayout<4, true>;
+
+// Calls Callback with the layout of the slice Obj.
+template <typename CallbackT>
+void dispatchSliceLayout(const MachOObjectFile* Obj, CallbackT&& Callback)
+{
+    if (Obj->isLittleEndian()) {
+        if (Obj->is64Bit())
+            Callback(Layout64LE {});
+        else
+            Callback(Layout32LE {});
+    } else {
+        if (Obj->is64Bit())
+            Callback(Layout64BE {});
+        else
+            Callback(Layout32BE {});
+    }
+}
+
+// Adds the names pointed to by a __objc_catlist section to Slice. Names that are already in
+// the index, e.g. because they live in __objc_classname, are not added a second time. In slices
+// with chained fixups, pointers are resolved through Fixups instead of being read as addresses.
+//
+// The list is processed in passes over the whole section rather than entry by entry: first all
+// pointers are decoded and translated, then the category structs and finally the names are read,
+// each prefetched a few entries ahead, so their cache misses overlap instead of serializing.
+template <typename Layout>
+void indexCategoryListSection(const SectionInfo&       Section,
+                              const MachOObjectFile*   MachOObj,
+                              const SegmentTable&      Segments,
+                              const ChainedFixupTable& Fixups,
+                              SliceNames&              Slice,
+                              DenseSet<uint64_t>&      Seen)
+{
+    StringRef          SliceContents = MachOObj->getData();
+    constexpr unsigned PtrSize       = Layout::PointerSize;
+    constexpr uint64_t Invalid       = std::numeric_limits<uint64_t>::max();
+    constexpr size_t   Distance      = 8;
+    const size_t       Count         = Section.Size / PtrSize;
+
+    // Decode the list. Without fixups this is a plain loop of loads and masks that the compiler
+    // vectorizes.
+    std::vector<uint64_t> Offsets(Count);
+    if (Fixups.empty()) {
+        const char* List = SliceContents.data() + Section.FileOffset;
+        for (size_t i = 0; i < Count; ++i)
+            Offsets[i] = Layout::readPointer(List + i * PtrSize) & Layout::AddressMask;
+    } else {
+        for (size_t i = 0; i < Count; ++i) {
+            auto It    = Fixups.find(Section.FileOffset + i * PtrSize);
+            Offsets[i] = It != Fixups.end() ? It->second : Invalid;
+        }
+    }
+
+    // Translates the addresses in Offsets to file offsets in place; Needed is the number of bytes
+    // that must be readable at the result.
+    auto translate = [&](uint64_t Needed) {
+        for (uint64_t& Offset : Offsets) {
+            if (Offset == Invalid)
+                continue;
+            auto FileOffset = Segments.toFileOffset(Offset);
+            Offset          = FileOffset && *FileOffset + Needed <= SliceContents.size()
+                                  ? *FileOffset
+                                  : Invalid;
+        }
+    };
+    translate(PtrSize);
+
+    // The name is the first field of category_t.
+    for (size_t i = 0; i < Count; ++i) {
+        if (i + Distance < Count && Offsets[i + Distance] != Invalid)
+            __builtin_prefetch(SliceContents.data() + Offsets[i + Distance]);
+        if (Offsets[i] == Invalid)
+            continue;
+        if (Fixups.empty()) {
+            Offsets[i] = Layout::readPointer(SliceContents.data() + Offsets[i])
+                         & Layout::AddressMask;
+        } else {
+            auto It    = Fixups.find(Offsets[i]);
+            Offsets[i] = It != Fixups.end() ? It->second : Invalid;
+        }
+    }
+    translate(1);
+
+    Slice.Names.reserve(Slice.Names.size() + Count);
+    Seen.reserve(Seen.size() + Count);
+    AllocationScope Allocations;
+    for (size_t i = 0; i < Count; ++i) {
+        if (i + Distance < Count && Offsets[i + Distance] != Invalid)
+            __builtin_prefetch(SliceContents.data() + Offsets[i + Distance]);
+        if (Offsets[i] == Invalid)
+            continue;
+
+        // Names must be terminated within the slice.
+        StringRef      Rest           = SliceContents.drop_front(Offsets[i]);
+        const size_t   Length         = Rest.find('\0');
+        const uint64_t RealNameOffset = Slice.Offset + Offsets[i];
+        if (Length == 0 || Length == StringRef::npos)
+            continue;
+        ++HotLoopStats.Categories;
+        HotLoopStats.FixedUpCategories += !Fixups.empty();
+        if (!Seen.insert(RealNameOffset).second)
+            continue;
+        StringRef CategoryName = Rest.take_front(Length);
+
+        Slice.Names.push_back({RealNameOffset, CategoryName, PatchReason::CategoryName, false});
+    }
+}
+
+// Builds the name index of a single Mach-O binary slice.
+Expected<SliceNames> indexMachOSlice(const MachOObjectFile* MachOObj,
+                                     uint64_t               SliceOffset,
+                                     const CommandLineArgs& args)
+{
+    SliceNames Slice {MachOObj->getArchTriple().getArchName().str(),
+                      SliceOffset,
+                      MachOObj->getData().size(),
+                      readSliceUUID(MachOObj->getData()),
+                      {}};
+
+    SectionDirectory   Sections(MachOObj);
+    SegmentTable       Segments(MachOObj);
+    DenseSet<uint64_t> Seen;
+    for (const SectionInfo& Section : Sections.classNameSections())
+        indexClassNameSection(Section, MachOObj->getData(), Slice, Seen, args);
+
+    if (Sections.categoryListSections().empty())
+        return Slice;
+    ChainedFixupTable Fixups;
+    if (Error E = decodeChainedFixups(MachOObj, Fixups)) {
+        errs() << "Warning: skipping categories of " << Slice.ArchName
+               << ", cannot decode chained fixups: " << toString(std::move(E)) << "\n";
+        return Slice;
+    }
+    dispatchSliceLayout(MachOObj, [&](auto Layout) {
+        for (const SectionInfo& Section : Sections.categoryListSections())
+            indexCategoryListSection<decltype(Layout)>(
+                Section, MachOObj, Segments, Fixups, Slice, Seen);
+    });
+    return Slice;
+}
+
+// Calls Callback(Offset, Length) for occurrences of the patterns of Matcher in Contents, at least
+// one in every stretch of Contents without NUL bytes that contains a pattern. A single pattern is
+// found with a vectorized substring search: a position is only compared with the pattern if it
+// holds the first byte of the pattern and the last byte is at the right distance, which two vector
+// compares per 64 bytes rule out for almost every position. Several patterns would each take such
+// a pass, so they are found in one pass of the automaton instead.
+template <typename CallbackT>
+void forEachPatternOccurrence(StringRef                 Contents,
+                              const ReplacementMatcher& Matcher,
+                              CallbackT&&               Callback)
+{
+    if (Matcher.pairs().size() != 1) {
+        Matcher.forEachMatch(Contents, [&](size_t Offset, const ReplacementMatcher::Pair& Pair) {
+            Callback(Offset, Pair.Pattern.size());
+        });
+        return;
+    }
+
+    const StringRef Pattern = Matcher.pairs().front().Pattern;
+    if (Pattern.size() > Contents.size())
+        return;
+
+    // Block is a candidate start; the last byte of the pattern is loaded from further ahead, so
+    // the vector loop stops where that load would leave Contents.
+    const uint64_t NumStarts = Contents.size() - Pattern.size() + 1;
+    uint64_t       Block     = 0;
+    for (; Block + 64 <= NumStarts; Block += 64) {
+        uint64_t Candidates
+            = byteMask64(Contents.data() + Block, Pattern.front())
+              & byteMask64(Contents.data() + Block + Pattern.size() - 1, Pattern.back());
+        for (; Candidates; Candidates &= Candidates - 1) {
+            const uint64_t Offset = Block + std::countr_zero(Candidates);
+            if (memcmp(Contents.data() + Offset, Pattern.data(), Pattern.size()) == 0)
+                Callback(Offset, Pattern.size());
+        }
+    }
+    for (; Block < NumStarts; ++Block) {
+        if (Contents.substr(Block, Pattern.size()) == Pattern)
+            Callback(Block, Pattern.size());
+    }
+}
+
+// Replace mode: returns a bit for each of Names that is set if the name contains one of the
+// patterns. The names of a __objc_classname section lie back to back, separated by NULs, so runs
+// of them are searched as one block and each hit is mapped back to the name containing it; names
+// without a hit are never looked at. Names from elsewhere are always set.
+BitVector findReplaceCandidates(ArrayRef<NameEntry> Names, const ReplacementMatcher& Matcher)
+{
+    BitVector Candidates(Names.size(), true);
+
+    // Two names are in the same run if they come from the same buffer in file order with at most
+    // a block of padding between them. Padding of other sections is never scanned that way.
+    auto continuesRun = [](const NameEntry& Prev, const NameEntry& Next) {
+        const uint64_t Distance = Next.FileOffset - Prev.FileOffset;
+        return Prev.Reason == PatchReason::ClassName && Next.Reason == PatchReason::ClassName
+               && Next.FileOffset > Prev.FileOffset + Prev.Name.size()
+               && Distance <= Prev.Name.size() + 64
+               && uint64_t(Next.Name.data() - Prev.Name.data()) == Distance;
+    };
+
+    for (size_t First = 0; First < Names.size();) {
+        if (Names[First].Reason != PatchReason::ClassName) {
+            ++First;
+            continue;
+        }
+        size_t End = First + 1;
+        while (End < Names.size() && continuesRun(Names[End - 1], Names[End]))
+            ++End;
+
+        ArrayRef<NameEntry> Run   = Names.slice(First, End - First);
+        const char*         Begin = Run.front().Name.data();
+        Candidates.reset(First, End);
+        forEachPatternOccurrence(
+            StringRef(Begin, Run.back().Name.end() - Begin),
+            Matcher,
+            [&](uint64_t Offset, size_t Length) {
+                const char* Hit          = Begin + Offset;
+                auto        StartsBefore = [&](const NameEntry& E) { return E.Name.data() <= Hit; };
+
+                // Only the last name that starts at or before the hit can contain it.
+                auto Entry = std::prev(std::partition_point(Run.begin(), Run.end(), StartsBefore));
+                if (Hit + Length <= Entry->Name.end())
+                    Candidates.set(First + (Entry - Run.begin()));
+            });
+        First = End;
+    }
+    return Candidates;
+}
+
+// Open-addressing hash set of the names of a slice, original and generated, that keeps generated
+// names unique. Each name is recorded with the original it stands for, an original name with
+// itself, so a generated name only collides with a name that stands for a different original.
+// Generated names are copied into a pool; the table and the pool are sized up front, so inserting
+// never allocates.
+class UniqueNameIndex
+{
+public:
+    // Prepares for the original names of Names and one generated name for each of them.
+    void reset(ArrayRef<NameEntry> Names)
+    {
+        size_t NumBytes = 0;
+        for (const NameEntry& Entry : Names)
+            NumBytes += Entry.Name.size();
+
+        // At most half full, so that probe sequences stay short.
+        size_t Capacity = 16;
+        while (Capacity < 4 * Names.size())
+            Capacity *= 2;
+        Slots.assign(Capacity, Slot {});
+        Pool.clear();
+        Pool.reserve(NumBytes);
+
+        for (const NameEntry& Entry : Names)
+            insert(Entry.Name, Entry.Name);
+    }
+
+    // Records Name as standing for Original, unless it already stands for a different name.
+    // Returns whether Name can be used.
+    bool insert(StringRef Name, StringRef Original)
+    {
+        const uint64_t Hash = xxHash64(Name);
+        const size_t   Mask = Slots.size() - 1;
+        for (size_t Index = Hash & Mask;; Index = (Index + 1) & Mask) {
+            Slot& S = Slots[Index];
+            if (S.Name.data() == nullptr) {
+                // Original names stay in the mapped binary; generated ones live in the overlay,
+                // which may move them as it grows, so they need a copy.
+                if (Name.data() != Original.data()) {
+                    const size_t Offset = Pool.size();
+                    Pool.insert(Pool.end(), Name.begin(), Name.end());
+                    Name = StringRef(Pool.data() + Offset, Name.size());
+                }
+                S = {Hash, Name, Original};
+                return true;
+            }
+            if (S.Hash == Hash && S.Name == Name)
+                return S.Original == Original;
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint64_t  Hash;
+        StringRef Name;
+        StringRef Original;
+    };
+
+    std::vector<Slot> Slots;
+    std::vector<char> Pool;
+};
+
+// Replaces the file at Path with Contents, through a temporary file renamed over it, so readers
+// never see a partially written file.
+Error writeFileAtomically(StringRef Path, StringRef Contents)
+{
+    Expected<sys::fs::TempFile> TempOrErr = sys::fs::TempFile::create(Path + ".tmp-%%%%%%%%");
+    if (!TempOrErr)
+        return TempOrErr.takeError();
+    {
+        raw_fd_ostream OS(TempOrErr->FD, /*shouldClose=*/false);
+        OS << Contents;
+        OS.flush();
+        if (OS.has_error())
+            return joinErrors(createFileError(TempOrErr->TmpName, OS.error()),
+                              TempOrErr->discard());
+    }
+    return TempOrErr->keep(Path);
+}
+
+// Name mapping databases record the new name of each original name, so that later runs give a
+// name the same new name again and crash logs can be symbolicated. The file is used as mapped,
+// without parsing; names are looked up through hash indexes over both columns. All integers are
+// little endian:
+//   "OBJCMAPD", u32 version, u32 entry count, u32 bucket count (a power of two), u32 pool size,
+//   entries, sorted by original name: u32 original name offset, u32 new name offset, u32 length,
+//   original name index: per bucket, u32 entry index + 1, or 0 if the bucket is empty,
+//   new name index: the same for the new names,
+//   string pool: per entry, the original name, NUL, the new name, NUL.
+// Name offsets are relative to the string pool. A name is found by probing the buckets linearly,
+// starting at its xxHash64 modulo the bucket count.
+constexpr StringLiteral MappingMagic      = "OBJCMAPD";
+constexpr uint32_t      MappingVersion    = 1;
+constexpr size_t        MappingHeaderSize = 24;
+constexpr size_t        MappingEntrySize  = 12;
+
+class NameMapping
+{
+public:
+    // Maps the database at Path. A missing file is an empty database.
+    Error load(StringRef Path)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr
+            = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (std::error_code EC = FileOrErr.getError()) {
+            if (EC == std::errc::no_such_file_or_directory)
+                return Error::success();
+            return createFileError(Path, EC);
+        }
+
+        const StringRef Data = (*FileOrErr)->getBuffer();
+        auto            invalid = [&] {
+            return createStringError(std::errc::invalid_argument,
+                                     "%s is not a valid name mapping database",
+                                     Path.str().c_str());
+        };
+        if (Data.size() < MappingHeaderSize || Data.take_front(MappingMagic.size()) != MappingMagic
+            || support::endian::read32le(Data.data() + 8) != MappingVersion)
+            return invalid();
+
+        NumEntries = support::endian::read32le(Data.data() + 12);
+        NumBuckets = support::endian::read32le(Data.data() + 16);
+
+        const uint64_t PoolSize    = support::endian::read32le(Data.data() + 20);
+        const uint64_t EntriesSize = uint64_t(NumEntries) * MappingEntrySize;
+        const uint64_t IndexSize   = uint64_t(NumBuckets) * sizeof(uint32_t);
+        if (!isPowerOf2_32(NumBuckets) || NumBuckets < NumEntries
+            || Data.size() != MappingHeaderSize + EntriesSize + 2 * IndexSize + PoolSize)
+            return invalid();
+
+        Entries       = Data.substr(MappingHeaderSize, EntriesSize);
+        OriginalIndex = Data.substr(MappingHeaderSize + EntriesSize, IndexSize);
+        NewIndex      = Data.substr(MappingHeaderSize + EntriesSize + IndexSize, IndexSize);
+        Pool          = Data.substr(MappingHeaderSize + EntriesSize + 2 * IndexSize);
+        File          = std::move(*FileOrErr);
+        return Error::success();
+    }
+
+    // Makes room for NumNames new names of NumBytes in total; must be called before the first
+    // assign(), so that assigning never allocates.
+    void reserve(size_t NumNames, size_t NumBytes)
+    {
+        Assigned.reserve(NumNames);
+        AssignedOriginals.reserve(NumNames);
+        Names.reserve(NumBytes);
+    }
+
+    // Returns the new name recorded for Original, if any.
+    std::optional<StringRef> find(StringRef Original) const
+    {
+        if (auto It = Assigned.find(Original); It != Assigned.end())
+            return It->second;
+        if (std::optional<uint32_t> Entry = findLoaded(Original, OriginalColumn))
+            return loadedName(*Entry, NewColumn);
+        return std::nullopt;
+    }
+
+    // Returns whether NewName is not recorded for any name but Original.
+    bool isAvailable(StringRef NewName, StringRef Original) const
+    {
+        if (auto It = AssignedOriginals.find(NewName); It != AssignedOriginals.end())
+            return It->second == Original;
+        if (std::optional<uint32_t> Entry = findLoaded(NewName, NewColumn))
+            return loadedName(*Entry, OriginalColumn) == Original;
+        return true;
+    }
+
+    // Records NewName for Original, which has to outlive the mapping.
+    void assign(StringRef Original, StringRef NewName)
+    {
+        const size_t Offset = Names.size();
+        Names.insert(Names.end(), NewName.begin(), NewName.end());
+        NewName                    = StringRef(Names.data() + Offset, NewName.size());
+        Assigned[Original]         = NewName;
+        AssignedOriginals[NewName] = Original;
+    }
+
+    // Writes the loaded names that were not reassigned and the assigned ones to Path.
+    Error store(StringRef Path) const
+    {
+        std::vector<std::pair<StringRef, StringRef>> Mappings(Assigned.begin(), Assigned.end());
+        for (uint32_t Entry = 0; Entry < NumEntries; ++Entry) {
+            const StringRef Original = loadedName(Entry, OriginalColumn);
+            const StringRef NewName  = loadedName(Entry, NewColumn);
+            if (!Original.empty() && NewName.size() == Original.size()
+                && !Assigned.count(Original))
+                Mappings.emplace_back(Original, NewName);
+        }
+        llvm::sort(Mappings);
+
+        uint32_t Buckets = 8;
+        while (Buckets < 2 * Mappings.size())
+            Buckets *= 2;
+
+        std::string Database(MappingHeaderSize, '\0');
+        memcpy(Database.data(), MappingMagic.data(), MappingMagic.size());
+        support::endian::write32le(&Database[8], MappingVersion);
+        support::endian::write32le(&Database[12], Mappings.size());
+        support::endian::write32le(&Database[16], Buckets);
+
+        // Entries, then both indexes, filled in below; the pool follows them.
+        const size_t EntriesStart = Database.size();
+        const size_t IndexesStart = EntriesStart + Mappings.size() * MappingEntrySize;
+        const size_t PoolStart    = IndexesStart + 2 * Buckets * sizeof(uint32_t);
+        Database.resize(PoolStart);
+        for (size_t Entry = 0; Entry < Mappings.size(); ++Entry) {
+            const auto& [Original, NewName] = Mappings[Entry];
+            const size_t Fields             = EntriesStart + Entry * MappingEntrySize;
+            support::endian::write32le(&Database[Fields], Database.size() - PoolStart);
+            Database += Original;
+            Database += '\0';
+            support::endian::write32le(&Database[Fields + 4], Database.size() - PoolStart);
+            Database += NewName;
+            Database += '\0';
+            support::endian::write32le(&Database[Fields + 8], Original.size());
+
+            for (unsigned Column : {OriginalColumn, NewColumn}) {
+                const StringRef Name   = Column == OriginalColumn ? Original : NewName;
+                const size_t    Index  = IndexesStart + Column * Buckets * sizeof(uint32_t);
+                uint32_t        Bucket = xxHash64(Name) & (Buckets - 1);
+                while (support::endian::read32le(&Database[Index + 4 * Bucket]) != 0)
+                    Bucket = (Bucket + 1) & (Buckets - 1);
+                support::endian::write32le(&Database[Index + 4 * Bucket], Entry + 1);
+            }
+        }
+        if (Database.size() - PoolStart > std::numeric_limits<uint32_t>::max())
+            return createStringError(std::errc::file_too_large,
+                                     "too many names for a name mapping database");
+        support::endian::write32le(&Database[20], Database.size() - PoolStart);
+
+        return writeFileAtomically(Path, Database);
+    }
+
+private:
+    static constexpr unsigned OriginalColumn = 0;
+    static constexpr unsigned NewColumn      = 1;
+
+    // Returns the name of the loaded entry in Column, or an empty name if the entry is corrupt.
+    StringRef loadedName(uint32_t Entry, unsigned Column) const
+    {
+        const char*    Fields = Entries.data() + Entry * MappingEntrySize;
+        const uint64_t Offset = support::endian::read32le(Fields + 4 * Column);
+        const uint64_t Length = support::endian::read32le(Fields + 8);
+        if (Offset + Length > Pool.size())
+            return StringRef();
+        return Pool.substr(Offset, Length);
+    }
+
+    // Returns the loaded entry whose name in Column is Name.
+    std::optional<uint32_t> findLoaded(StringRef Name, unsigned Column) const
+    {
+        const StringRef Index  = Column == OriginalColumn ? OriginalIndex : NewIndex;
+        uint32_t        Bucket = xxHash64(Name) & (NumBuckets - 1);
+        for (uint32_t Probe = 0; Probe < NumBuckets; ++Probe) {
+            const uint32_t Slot = support::endian::read32le(Index.data() + 4 * Bucket);
+            if (Slot == 0 || Slot > NumEntries)
+                return std::nullopt;
+            if (loadedName(Slot - 1, Column) == Name)
+                return Slot - 1;
+            Bucket = (Bucket + 1) & (NumBuckets - 1);
+        }
+        return std::nullopt;
+    }
+
+    std::unique_ptr<MemoryBuffer> File;
+    uint32_t                      NumEntries = 0;
+    uint32_t                      NumBuckets = 0;
+    StringRef                     Entries;
+    StringRef                     OriginalIndex;
+    StringRef                     NewIndex;
+    StringRef                     Pool;
+
+    // The names assigned in this run, and the bytes of the new ones.
+    DenseMap<StringRef, StringRef> Assigned;
+    DenseMap<StringRef, StringRef> AssignedOriginals;
+    std::vector<char>              Names;
+};
+
+// How often a new name is generated for a single original before giving up; only names so short
+// that most of their possible values are taken ever come close.
+constexpr unsigned MaxNameAttempts = 1000;
+
+// Transform strategies compute the new names of a slice. transformNames picks one per run and
+// instantiates its per-name loop for it, so the loop never asks which mode is active. A strategy
+// provides:
+//   void beginSlice(ArrayRef<NameEntry> Names)   prepares for the names of a slice; may allocate,
+//   bool mayChange(size_t Index)                 false if the name at Index certainly stays as is,
+//   Error transform(const NameEntry&, PatchOverlay&, StringRef& NewName)
+//                                                writes the new name to the overlay, and sets
+//                                                NewName to it unless the name was left alone.
+// New names are built in place in the overlay; nothing is allocated per name.
+
+// Replaces the patterns of a ReplacementMatcher. Patterns and replacements have the same length,
+// so the matches in the original name are at the same positions in the new one.
+class ReplaceStrategy
+{
+public:
+    explicit ReplaceStrategy(const ReplacementMatcher& Matcher) :
+        Matcher(Matcher)
+    {}
+
+    void beginSlice(ArrayRef<NameEntry> Names)
+    {
+        Candidates = findReplaceCandidates(Names, Matcher);
+    }
+
+    bool mayChange(size_t Index) const
+    {
+        return Candidates[Index];
+    }
+
+    Error transform(const NameEntry& Entry, PatchOverlay& Overlay, StringRef& NewName)
+    {
+        // The name is only patched once something matched.
+        MutableArrayRef<char> Bytes;
+        Matcher.forEachMatch(Entry.Name, [&](size_t Pos, const ReplacementMatcher::Pair& Pair) {
+            if (Bytes.empty()) {
+                Bytes = Overlay.write(Entry.FileOffset, Entry.Name.size(), Entry.Reason);
+                memcpy(Bytes.data(), Entry.Name.data(), Entry.Name.size());
+            }
+            memcpy(Bytes.data() + Pos, Pair.Replacement.data(), Pair.Replacement.size());
+        });
+        NewName = StringRef(Bytes.data(), Bytes.size());
+        return Error::success();
+    }
+
+private:
+    const ReplacementMatcher& Matcher;
+    BitVector                 Candidates;
+};
+
+// Name policies of GeneratedNameStrategy: fill(Name, Original, Attempt) writes a candidate for the
+// new name of Original; Attempt counts the candidates rejected before.
+struct RandomNames
+{
+    NameGenerator& Generator;
+
+    void fill(MutableArrayRef<char> Name, StringRef, unsigned)
+    {
+        Generator.fill(Name);
+    }
+};
+
+struct KeyedNames
+{
+    HashKey Key;
+
+    void fill(MutableArrayRef<char> Name, StringRef Original, unsigned Attempt) const
+    {
+        fillKeyedName(Name, Original, Key, Attempt);
+    }
+};
+
+// Generates new names with NamePolicy until one is free: unused in the slice and, with
+// UseMapping, not recorded in the mapping database for a different name. With UseMapping, the
+// name recorded for the original is kept if it is still free, and a newly generated name is
+// recorded.
+template <typename NamePolicy, bool UseMapping>
+class GeneratedNameStrategy
+{
+public:
+    GeneratedNameStrategy(NamePolicy Names, NameMapping* Mapping) :
+        Names(Names),
+        Mapping(Mapping)
+    {}
+
+    void beginSlice(ArrayRef<NameEntry> SliceNames)
+    {
+        UsedNames.reset(SliceNames);
+    }
+
+    bool mayChange(size_t) const
+    {
+        return true;
+    }
+
+    Error transform(const NameEntry& Entry, PatchOverlay& Overlay, StringRef& NewName)
+    {
+        MutableArrayRef<char> Bytes
+            = Overlay.write(Entry.FileOffset, Entry.Name.size(), Entry.Reason);
+        NewName = StringRef(Bytes.data(), Bytes.size());
+
+        auto isFree = [&] {
+            if constexpr (UseMapping) {
+                if (!Mapping->isAvailable(NewName, Entry.Name))
+                    return false;
+            }
+            return UsedNames.insert(NewName, Entry.Name);
+        };
+        bool Collided = false;
+        bool Reused   = false;
+        if constexpr (UseMapping) {
+            if (std::optional<StringRef> Recorded = Mapping->find(Entry.Name);
+                Recorded && Recorded->size() == Bytes.size()) {
+                memcpy(Bytes.data(), Recorded->data(), Recorded->size());
+                Reused = isFree();
+                if (!Reused) {
+                    Collided = true;
+                    ++HotLoopStats.Retries;
+                }
+            }
+        }
+        if (!Reused) {
+            for (unsigned Attempt = 0;; ++Attempt) {
+                if (Attempt == MaxNameAttempts)
+                    return createStringError(std::errc::resource_unavailable_try_again,
+                                             "no unique new name found for %s after %u attempts",
+                                             Entry.Name.str().c_str(),
+                                             MaxNameAttempts);
+                Names.fill(Bytes, Entry.Name, Attempt);
+                if (isFree())
+                    break;
+                Collided = true;
+                ++HotLoopStats.Retries;
+            }
+            if constexpr (UseMapping)
+                Mapping->assign(Entry.Name, NewName);
+        }
+        HotLoopStats.Collisions += Collided;
+        return Error::success();
+    }
+
+private:
+    NamePolicy      Names;
+    NameMapping*    Mapping;
+    UniqueNameIndex UsedNames;
+};
+
+// Digest of the names of a slice, with their kinds and exclusion; slices with the same names in
+// the same order have the same digest.
+uint64_t digestNames(ArrayRef<NameEntry> Names)
+{
+    uint64_t Digest = Names.size();
+    for (const NameEntry& Entry : Names) {
+        const uint64_t Flags = uint64_t(Entry.Reason) << 1 | Entry.Excluded;
+        Digest               = (Digest ^ xxHash64(Entry.Name) ^ Flags) * 0x9e3779b97f4a7c15;
+    }
+    return Digest;
+}
+
+bool haveSameNames(ArrayRef<NameEntry> A, ArrayRef<NameEntry> B)
+{
+    return A.size() == B.size()
+           && std::equal(A.begin(), A.end(), B.begin(), [](const NameEntry& X, const NameEntry& Y) {
+                  return X.Name == Y.Name && X.Reason == Y.Reason && X.Excluded == Y.Excluded;
+              });
+}
+
+// The per-name loop of transformNames, instantiated for each strategy. A slice with the same
+// names as an earlier one, as the slices of a universal binary usually have, is not transformed
+// again: the new names of the earlier slice are copied, so every slice renames a class the same
+// way.
+template <typename StrategyT>
+Error transformNamesWith(ArrayRef<SliceNames>   Index,
+                         PatchOverlay&          Overlay,
+                         StrategyT&             Strategy,
+                         const CommandLineArgs& args)
+{
+    SmallVector<uint64_t, 4> Digests;
+    for (const SliceNames& Slice : Index) {
+        if (!args.quietMode) {
+            args.log() << "--- Patching architecture: " << Slice.ArchName
+                       << " (slice offset: " << Slice.Offset << ") ---\n";
+        }
+
+        const SliceNames* Twin = nullptr;
+        Digests.push_back(digestNames(Slice.Names));
+        for (size_t Earlier = 0; Earlier + 1 < Digests.size() && !Twin; ++Earlier) {
+            if (Digests[Earlier] == Digests.back()
+                && haveSameNames(Index[Earlier].Names, Slice.Names))
+                Twin = &Index[Earlier];
+        }
+        if (Twin) {
+            if (!args.quietMode)
+                args.log() << "Same names as " << Twin->ArchName
+                           << " (slice offset: " << Twin->Offset << "), reusing its new names\n";
+        } else {
+            Strategy.beginSlice(Slice.Names);
+        }
+
+        HotLoopStats.Names += Slice.Names.size();
+        AllocationScope Allocations;
+        for (size_t Position = 0; Position < Slice.Names.size(); ++Position) {
+            const NameEntry& Entry = Slice.Names[Position];
+            StringRef        Tag   = patchReasonTag(Entry.Reason);
+            if (Entry.Excluded) {
+                if (!args.quietMode)
+                    args.log() << Tag << " Skipping excluded class: " << Entry.Name << "\n";
+                continue;
+            }
+
+            StringRef NewName;
+            if (Twin) {
+                const NameEntry& Source = Twin->Names[Position];
+                if (!Overlay.isPatched(Source.FileOffset))
+                    continue;
+                // Written first: growing the overlay may move the bytes of the source.
+                MutableArrayRef<char> Bytes
+                    = Overlay.write(Entry.FileOffset, Entry.Name.size(), Entry.Reason);
+                memcpy(Bytes.data(),
+                       Overlay.patchedBytes(Source.FileOffset, Bytes.size()).data(),
+                       Bytes.size());
+                NewName = StringRef(Bytes.data(), Bytes.size());
+            } else {
+                if (!Strategy.mayChange(Position))
+                    continue;
+                if (Error E = Strategy.transform(Entry, Overlay, NewName))
+                    return E;
+            }
+            if (!NewName.empty() && !args.quietMode) {
+                args.log() << Tag << " Found: " << Entry.Name << " at file offset "
+                           << Entry.FileOffset << "\n"
+                           << "  -> Replaced with: " << NewName << "\n";
+            }
+        }
+    }
+    return Error::success();
+}
+
+// Computes the new names for every slice in Index and collects them in Overlay. Generated names
+// are unique within their slice and never equal an original name of it. With a Mapping, each
+// original keeps the new name recorded for it whenever possible.
+Error transformNames(ArrayRef<SliceNames>   Index,
+                     PatchOverlay&          Overlay,
+                     NameGenerator&         Generator,
+                     const CommandLineArgs& args,
+                     NameMapping*           Mapping = nullptr)
+{
+    size_t NumNames = 0;
+    size_t NumBytes = 0;
+    for (const SliceNames& Slice : Index) {
+        NumNames += Slice.Names.size();
+        for (const NameEntry& Entry : Slice.Names)
+            NumBytes += Entry.Name.size();
+    }
+    Overlay.reserve(NumNames, NumBytes);
+    if (Mapping)
+        Mapping->reserve(NumNames, NumBytes);
+
+    if (!args.replacer.empty()) {
+        ReplaceStrategy Strategy(args.replacer);
+        return transformNamesWith(Index, Overlay, Strategy, args);
+    }
+
+    auto generateWith = [&](auto Names) {
+        using NamePolicy = decltype(Names);
+        if (Mapping) {
+            GeneratedNameStrategy<NamePolicy, true> Strategy(Names, Mapping);
+            return transformNamesWith(Index, Overlay, Strategy, args);
+        }
+        GeneratedNameStrategy<NamePolicy, false> Strategy(Names, nullptr);
+        return transformNamesWith(Index, Overlay, Strategy, args);
+    };
+    if (args.hashKey)
+        return generateWith(KeyedNames {*args.hashKey});
+    return generateWith(RandomNames {Generator});
+}
+
+// Patch plans store the edits of a run, so that they can be replayed on a byte-identical binary
+// without parsing it. All integers are little endian:
+//   "OBJCPLAN", u32 version, u64 file size,
+//   u32 slice count, per slice: u64 offset, u64 size, u8[16] LC_UUID (zeroes if none),
+//   u32 edit count, per edit: u32 slice index, u8 reason, u64 file offset, u32 size,
+//                             original bytes, new bytes.
+constexpr StringLiteral PlanMagic   = "OBJCPLAN";
+constexpr uint32_t      PlanVersion = 1;
+
+Error writePatchPlan(StringRef           Path,
+                     StringRef           FileContents,
+                     const NameIndex&    Slices,
+                     const PatchOverlay& Overlay)
+{
+    std::string Plan;
+    auto        append32 = [&](uint32_t Value) {
+        char Bytes[4];
+        support::endian::write32le(Bytes, Value);
+        Plan.append(Bytes, sizeof(Bytes));
+    };
+    auto append64 = [&](uint64_t Value) {
+        char Bytes[8];
+        support::endian::write64le(Bytes, Value);
+        Plan.append(Bytes, sizeof(Bytes));
+    };
+
+    Plan += PlanMagic;
+    append32(PlanVersion);
+    append64(FileContents.size());
+    append32(Slices.size());
+    for (const SliceNames& Slice : Slices) {
+        append64(Slice.Offset);
+        append64(Slice.Size);
+        Plan.append(reinterpret_cast<const char*>(Slice.UUID.data()), Slice.UUID.size());
+    }
+
+    append32(Overlay.records().size());
+    for (const PatchOverlay::Record& Edit : Overlay.records()) {
+        auto SliceIt = llvm::upper_bound(
+            Slices, Edit.FileOffset, [](uint64_t Offset, const SliceNames& Slice) {
+                return Offset < Slice.Offset;
+            });
+        append32(SliceIt == Slices.begin() ? 0 : std::prev(SliceIt) - Slices.begin());
+        Plan += static_cast<char>(Edit.Reason);
+        append64(Edit.FileOffset);
+        append32(Edit.Size);
+        Plan += FileContents.substr(Edit.FileOffset, Edit.Size);
+        Plan += Overlay.patchedBytes(Edit.FileOffset, Edit.Size);
+    }
+    return writeFileAtomically(Path, Plan);
+}
+
+// Replays the edits of the patch plan at Path into Overlay, after checking that the binary in
+// FileContents is the one the plan was made for: same size, same slice UUIDs and the same original
+// bytes at every edit.
+Error applyPatchPlan(StringRef              Path,
+                     StringRef              FileContents,
+                     PatchOverlay&          Overlay,
+                     const CommandLineArgs& args)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> PlanOrErr
+        = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (std::error_code EC = PlanOrErr.getError())
+        return createFileError(Path, EC);
+
+    auto mismatch = [&](const Twine& Message) {
+        return createStringError(std::errc::invalid_argument,
+                                 "patch plan %s does not match the binary: %s",
+                                 Path.str().c_str(),
+                                 Message.str().c_str());
+    };
+
+    DataExtractor         Data((*PlanOrErr)->getBuffer(), /*IsLittleEndian=*/true, 8);
+    DataExtractor::Cursor C(0);
+    if (Data.getBytes(C, PlanMagic.size()) != PlanMagic || Data.getU32(C) != PlanVersion) {
+        consumeError(C.takeError());
+        return createStringError(
+            std::errc::invalid_argument, "%s is not a patch plan", Path.str().c_str());
+    }
+    if (Data.getU64(C) != FileContents.size()) {
+        consumeError(C.takeError());
+        return mismatch("file size differs");
+    }
+
+    const uint32_t NumSlices = Data.getU32(C);
+    for (uint32_t Index = 0; C && Index < NumSlices; ++Index) {
+        const uint64_t Offset = Data.getU64(C);
+        const uint64_t Size   = Data.getU64(C);
+        SliceUUID      UUID;
+        Data.getU8(C, UUID.data(), UUID.size());
+        if (!C)
+            break;
+        if (Offset > FileContents.size() || Size > FileContents.size() - Offset)
+            return mismatch("slice out of bounds");
+        if (readSliceUUID(FileContents.substr(Offset, Size)) != UUID)
+            return mismatch("LC_UUID differs");
+    }
+
+    const uint32_t NumEdits = Data.getU32(C);
+    for (uint32_t Index = 0; C && Index < NumEdits; ++Index) {
+        const uint32_t    SliceIndex  = Data.getU32(C);
+        const PatchReason Reason      = static_cast<PatchReason>(Data.getU8(C));
+        const uint64_t    FileOffset  = Data.getU64(C);
+        const uint32_t    Size        = Data.getU32(C);
+        StringRef         Original    = Data.getBytes(C, Size);
+        StringRef         Replacement = Data.getBytes(C, Size);
+        if (!C)
+            break;
+        if (SliceIndex >= NumSlices || FileOffset > FileContents.size()
+            || Size > FileContents.size() - FileOffset)
+            return mismatch("edit out of bounds");
+        if (FileContents.substr(FileOffset, Size) != Original)
+            return mismatch("original bytes differ at file offset " + Twine(FileOffset));
+
+        if (!args.quietMode) {
+            args.log() << patchReasonTag(Reason) << " Found: " << Original << " at file offset "
+                       << FileOffset << "\n"
+                       << "  -> Replaced with: " << Replacement << "\n";
+        }
+        Overlay.write(FileOffset, Replacement, Reason);
+    }
+    if (Error E = C.takeError())
+        return createFileError(Path, std::move(E));
+    return Error::success();
+}
+
+// Parses the binary and appends the name index of each of its slices to Index.
+Error indexBinary(MemoryBufferRef FileMB, NameIndex& Index, const CommandLineArgs& args)
+{
+    Expected<std::unique_ptr<Binary>> BinOrErr = createBinary(FileMB);
+    if (!BinOrErr)
+        return BinOrErr.takeError();
+    Binary& Bin = **BinOrErr;
+
+    if (auto* MachOUni = dyn_cast<MachOUniversalBinary>(&Bin)) {
+        for (const auto& ObjForArch : MachOUni->objects()) {
+            StringRef SliceBytes
+                = FileMB.getBuffer().substr(ObjForArch.getOffset(), ObjForArch.getSize());
+            if (!isSliceSelected(ObjForArch.getArchFlagName(), SliceBytes, args)) {
+                if (!args.quietMode)
+                    args.log() << "--- Skipping architecture: " << ObjForArch.getArchFlagName()
+                               << " (slice offset: " << ObjForArch.getOffset() << ") ---\n";
+                continue;
+            }
+
+            Expected<std::unique_ptr<MachOObjectFile>> MachOObjOrErr = ObjForArch.getAsObjectFile();
+            if (auto E = MachOObjOrErr.takeError()) {
+                errs() << "Failed to get object for architecture: " << toString(std::move(E))
+                       << "\n";
+                continue;
+            }
+            Expected<SliceNames> SliceOrErr
+                = indexMachOSlice(MachOObjOrErr->get(), ObjForArch.getOffset(), args);
+            if (auto E = SliceOrErr.takeError()) {
+                errs() << "Failed to patch Mach-O slice: " << toString(std::move(E)) << "\n";
+                continue;
+            }
+            Index.push_back(std::move(*SliceOrErr));
+        }
+    } else if (auto* MachOObj = dyn_cast<MachOObjectFile>(&Bin)) {
+        const MachO::mach_header Header = MachOObj->getHeader();
+        const std::string        Arch   = archFlagName(Header.cputype, Header.cpusubtype);
+        if (!isSliceSelected(Arch, MachOObj->getData(), args)) {
+            if (!args.quietMode)
+                args.log() << "--- Skipping architecture: " << Arch << " (slice offset: 0) ---\n";
+            return Error::success();
+        }
+        Expected<SliceNames> SliceOrErr = indexMachOSlice(MachOObj, 0, args);
+        if (!SliceOrErr)
+            return SliceOrErr.takeError();
+        Index.push_back(std::move(*SliceOrErr));
+    } else {
+        return createStringError(std::errc::invalid_argument,
+                                 "The provided file is not a valid Mach-O binary.");
+    }
+    return Error::success();
+}
+
+// Layout caches keep the name indexes of binaries across runs, so that an unchanged binary is not
+// parsed again. An entry is used if the file size, modification time, slice selection and slice
+// UUIDs all match; the names themselves are read from the binary. All integers are little endian:
+//   "OBJCLAYC", u32 version, then entries up to the end of the file:
+//   u32 entry size, u32 path length, absolute path of the binary, u64 file size,
+//   u64 modification time (ns), u32 selection length, --arch/--platform selection,
+//   u32 slice count, per slice: u64 offset, u64 size, u8[16] LC_UUID, u32 arch length, arch,
+//                               u32 name count, per name: u64 file offset, u32 length, u8 reason.
+constexpr StringLiteral LayoutCacheMagic   = "OBJCLAYC";
+constexpr uint32_t      LayoutCacheVersion = 1;
+
+struct LayoutCacheKey
+{
+    std::string Path;
+    uint64_t    FileSize;
+    uint64_t    ModificationTime;
+    std::string Selection;
+};
+
+Expected<LayoutCacheKey> makeLayoutCacheKey(const CommandLineArgs& args)
+{
+    LayoutCacheKey   Key;
+    SmallString<256> Path(args.binaryPath);
+    if (std::error_code EC = sys::fs::make_absolute(Path))
+        return createFileError(args.binaryPath, EC);
+    sys::fs::file_status Status;
+    if (std::error_code EC = sys::fs::status(Path, Status))
+        return createFileError(args.binaryPath, EC);
+
+    Key.Path             = Path.str().str();
+    Key.FileSize         = Status.getSize();
+    Key.ModificationTime = Status.getLastModificationTime().time_since_epoch().count();
+    for (const std::string& Arch : args.archs)
+        Key.Selection += Arch + ",";
+    Key.Selection += ";";
+    for (uint32_t Platform : args.platforms)
+        Key.Selection += std::to_string(Platform) + ",";
+    return Key;
+}
+
+// Looks up the binary in the layout cache at CachePath and fills Index from the matching entry.
+// Returns false if there is none; a missing or malformed cache is treated as empty.
+bool loadLayoutCache(StringRef              CachePath,
+                     const LayoutCacheKey&  Key,
+                     StringRef              FileContents,
+                     NameIndex&             Index,
+                     const CommandLineArgs& args)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> CacheOrErr
+        = MemoryBuffer::getFile(CachePath, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!CacheOrErr)
+        return false;
+
+    DataExtractor         Data((*CacheOrErr)->getBuffer(), /*IsLittleEndian=*/true, 8);
+    DataExtractor::Cursor C(0);
+    if (Data.getBytes(C, LayoutCacheMagic.size()) != LayoutCacheMagic
+        || Data.getU32(C) != LayoutCacheVersion) {
+        consumeError(C.takeError());
+        return false;
+    }
+
+    while (C && !Data.eof(C)) {
+        const uint32_t EntrySize = Data.getU32(C);
+        const uint64_t NextEntry = C.tell() + EntrySize;
+        Data.skip(C, Data.getU32(C)); // The path only identifies entries to replace.
+        const uint64_t  FileSize         = Data.getU64(C);
+        const uint64_t  ModificationTime = Data.getU64(C);
+        const StringRef Selection        = Data.getBytes(C, Data.getU32(C));
+        if (!C)
+            break;
+        if (FileSize != Key.FileSize || FileSize != FileContents.size()
+            || ModificationTime != Key.ModificationTime || Selection != Key.Selection) {
+            C.seek(NextEntry);
+            continue;
+        }
+
+        bool           Matches   = true;
+        const uint32_t NumSlices = Data.getU32(C);
+        for (uint32_t SliceIndex = 0; C && Matches && SliceIndex < NumSlices; ++SliceIndex) {
+            SliceNames Slice;
+            Slice.Offset = Data.getU64(C);
+            Slice.Size   = Data.getU64(C);
+            Data.getU8(C, Slice.UUID.data(), Slice.UUID.size());
+            Slice.ArchName = Data.getBytes(C, Data.getU32(C)).str();
+            if (!C || Slice.Offset > FileSize || Slice.Size > FileSize - Slice.Offset
+                || readSliceUUID(FileContents.substr(Slice.Offset, Slice.Size)) != Slice.UUID) {
+                Matches = false;
+                break;
+            }
+
+            const uint32_t NumNames = Data.getU32(C);
+            for (uint32_t Name = 0; C && Name < NumNames; ++Name) {
+                const uint64_t    FileOffset = Data.getU64(C);
+                const uint32_t    Length     = Data.getU32(C);
+                const PatchReason Reason     = static_cast<PatchReason>(Data.getU8(C));
+                if (FileOffset < Slice.Offset || FileOffset > Slice.Offset + Slice.Size
+                    || Length > Slice.Offset + Slice.Size - FileOffset) {
+                    Matches = false;
+                    break;
+                }
+                StringRef Text     = FileContents.substr(FileOffset, Length);
+                bool      Excluded = Reason == PatchReason::ClassName
+                                && args.excludedClasses.count(std::string_view(Text)) != 0;
+                Slice.Names.push_back({FileOffset, Text, Reason, Excluded});
+            }
+            Index.push_back(std::move(Slice));
+        }
+        if (C && Matches)
+            return true;
+
+        Index.clear();
+        if (!C)
+            break;
+        C.seek(NextEntry);
+    }
+    consumeError(C.takeError());
+    return false;
+}
+
+// Records Index as the layout of the binary in the layout cache at CachePath, replacing any
+// earlier entry for the same path. The cache is rewritten through a temporary file.
+Error storeLayoutCache(StringRef CachePath, const LayoutCacheKey& Key, const NameIndex& Index)
+{
+    std::string Cache;
+    auto        append32 = [&](uint32_t Value) {
+        char Bytes[4];
+        support::endian::write32le(Bytes, Value);
+        Cache.append(Bytes, sizeof(Bytes));
+    };
+    auto append64 = [&](uint64_t Value) {
+        char Bytes[8];
+        support::endian::write64le(Bytes, Value);
+        Cache.append(Bytes, sizeof(Bytes));
+    };
+    auto appendString = [&](StringRef String) {
+        append32(String.size());
+        Cache += String;
+    };
+
+    Cache += LayoutCacheMagic;
+    append32(LayoutCacheVersion);
+
+    // Keep the entries of other binaries.
+    ErrorOr<std::unique_ptr<MemoryBuffer>> OldOrErr
+        = MemoryBuffer::getFile(CachePath, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (OldOrErr) {
+        DataExtractor         Data((*OldOrErr)->getBuffer(), /*IsLittleEndian=*/true, 8);
+        DataExtractor::Cursor C(0);
+        if (Data.getBytes(C, LayoutCacheMagic.size()) == LayoutCacheMagic
+            && Data.getU32(C) == LayoutCacheVersion) {
+            while (C && !Data.eof(C)) {
+                const uint64_t  EntryStart = C.tell();
+                const uint32_t  EntrySize  = Data.getU32(C);
+                const StringRef Entry      = Data.getBytes(C, EntrySize);
+                uint64_t        PathOffset = EntryStart + sizeof(uint32_t);
+                const uint32_t  PathSize   = Data.getU32(&PathOffset);
+                if (C && Data.getBytes(&PathOffset, PathSize) != Key.Path) {
+                    append32(EntrySize);
+                    Cache += Entry;
+                }
+            }
+        }
+        consumeError(C.takeError());
+    }
+
+    const size_t EntryStart = Cache.size();
+    append32(0);
+    appendString(Key.Path);
+    append64(Key.FileSize);
+    append64(Key.ModificationTime);
+    appendString(Key.Selection);
+    append32(Index.size());
+    for (const SliceNames& Slice : Index) {
+        append64(Slice.Offset);
+        append64(Slice.Size);
+        Cache.append(reinterpret_cast<const char*>(Slice.UUID.data()), Slice.UUID.size());
+        appendString(Slice.ArchName);
+        append32(Slice.Names.size());
+        for (const NameEntry& Entry : Slice.Names) {
+            append64(Entry.FileOffset);
+            append32(Entry.Name.size());
+            Cache += static_cast<char>(Entry.Reason);
+        }
+    }
+    support::endian::write32le(&Cache[EntryStart], Cache.size() - EntryStart - sizeof(uint32_t));
+    return writeFileAtomically(CachePath, Cache);
+}
+
+// Builds the name index of the binary, or takes it from the layout cache if one is configured and
+// holds an entry for the binary.
+Error indexBinaryCached(MemoryBufferRef FileMB, NameIndex& Index, const CommandLineArgs& args)
+{
+    if (args.layoutCachePath.empty())
+        return indexBinary(FileMB, Index, args);
+
+    Expected<LayoutCacheKey> KeyOrErr = makeLayoutCacheKey(args);
+    if (!KeyOrErr)
+        return KeyOrErr.takeError();
+    if (loadLayoutCache(args.layoutCachePath, *KeyOrErr, FileMB.getBuffer(), Index, args)) {
+        if (!args.quietMode)
+            args.log() << "Using cached layout from " << args.layoutCachePath << "\n";
+        return Error::success();
+    }
+
+    if (Error E = indexBinary(FileMB, Index, args))
+        return E;
+    if (Error E = storeLayoutCache(args.layoutCachePath, *KeyOrErr, Index))
+        errs() << "Warning: could not update layout cache: " << toString(std::move(E)) << "\n";
+    return Error::success();
+}
+
+// Copies the whole contents of InFD into the empty file OutFD. Where the file system supports it
+// the copy is a reflink (FICLONE) that shares all data blocks with the input, otherwise the kernel
+// copies the data (copy_file_range), and as a last resort it is copied through user space.
+std::error_code copyFileContents(int InFD, int OutFD, uint64_t Size)
+{
+    auto lastError = [] { return std::error_code(errno, std::generic_category()); };
+
+#if defined(__linux__)
+    if (::ioctl(OutFD, FICLONE, InFD) == 0)
+        return {};
+
+    uint64_t Copied = 0;
+    while (Copied < Size) {
+        ssize_t Result = sys::RetryAfterSignal(
+            -1, ::copy_file_range, InFD, nullptr, OutFD, nullptr, Size - Copied, 0);
+        if (Result <= 0)
+            break;
+        Copied += Result;
+    }
+    if (Copied == Size)
+        return {};
+    if (Copied != 0)
+        return lastError();
+#endif
+
+    constexpr size_t  ChunkSize = 1 << 20;
+    std::vector<char> Chunk(ChunkSize);
+    uint64_t          Offset = 0;
+    while (Offset < Size) {
+        ssize_t Read = sys::RetryAfterSignal(
+            -1, ::pread, InFD, Chunk.data(), std::min<uint64_t>(ChunkSize, Size - Offset), Offset);
+        if (Read <= 0)
+            return Read == 0 ? std::make_error_code(std::errc::io_error) : lastError();
+        for (ssize_t Done = 0; Done < Read;) {
+            ssize_t Written = sys::RetryAfterSignal(
+                -1, ::pwrite, OutFD, Chunk.data() + Done, Read - Done, Offset + Done);
+            if (Written < 0)
+                return lastError();
+            Done += Written;
+        }
+        Offset += Read;
+    }
+    return {};
+}
+
+// Creates a uniquely named temporary file next to OutputPath holding a copy of the input file.
+std::error_code createClonedTempFile(int                    InFD,
+                                     uint64_t               Size,
+                                     StringRef              OutputPath,
+                                     SmallVectorImpl<char>& TempPath,
+                                     int&                   TempFD)
+{
+    SmallString<128> Model(OutputPath);
+    Model += ".tmp-%%%%%%%%";
+
+#if defined(__APPLE__)
+    // APFS clones have to be created by the kernel, at a path that does not exist yet.
+    for (int Attempt = 0; Attempt < 16; ++Attempt) {
+        sys::fs::createUniquePath(Model, TempPath, /*MakeAbsolute=*/false);
+        std::string TempPathStr(TempPath.begin(), TempPath.end());
+        if (::fclonefileat(InFD, AT_FDCWD, TempPathStr.c_str(), 0) == 0)
+            return sys::fs::openFileForReadWrite(
+                TempPath, TempFD, sys::fs::CD_OpenExisting, sys::fs::OF_None);
+        if (errno != EEXIST)
+            break;
+    }
+#endif
+
+    if (std::error_code EC = sys::fs::createUniqueFile(Model, TempFD, TempPath))
+        return EC;
+    if (std::error_code EC = copyFileContents(InFD, TempFD, Size)) {
+        sys::Process::SafelyCloseFileDescriptor(TempFD);
+        sys::fs::remove(TempPath);
+        return EC;
+    }
+    return {};
+}
+
+// Writes the patched binary to OutputPath without ever exposing a partially written file: the
+// input is cloned into a temporary file next to OutputPath, only the patched ranges are written
+// into the clone, and the clone is then renamed over OutputPath, which may be the input itself.
+Error writePatchedCopy(StringRef InputPath, StringRef OutputPath, const PatchOverlay& Overlay)
+{
+    int InFD = -1;
+    if (std::error_code EC = sys::fs::openFileForRead(InputPath, InFD))
+        return createFileError(InputPath, EC);
+    auto CloseInput = make_scope_exit([&] { sys::Process::SafelyCloseFileDescriptor(InFD); });
+
+    sys::fs::file_status Status;
+    if (std::error_code EC = sys::fs::status(InFD, Status))
+        return createFileError(InputPath, EC);
+
+    SmallString<128> TempPath;
+    int              TempFD = -1;
+    if (std::error_code EC
+        = createClonedTempFile(InFD, Status.getSize(), OutputPath, TempPath, TempFD))
+        return createFileError(OutputPath, EC);
+
+    bool Committed  = false;
+    auto RemoveTemp = make_scope_exit([&] {
+        if (TempFD != -1)
+            sys::Process::SafelyCloseFileDescriptor(TempFD);
+        if (!Committed)
+            sys::fs::remove(TempPath);
+    });
+
+    if (Error E = writePatches(TempFD, Overlay))
+        return createFileError(TempPath, std::move(E));
+    if (std::error_code EC = sys::fs::setPermissions(TempFD, Status.permissions()))
+        return createFileError(TempPath, EC);
+    if (::fsync(TempFD) != 0)
+        return createFileError(TempPath, std::error_code(errno, std::generic_category()));
+    if (std::error_code EC = sys::Process::SafelyCloseFileDescriptor(TempFD))
+        return createFileError(TempPath, EC);
+    TempFD = -1;
+
+    if (std::error_code EC = sys::fs::rename(TempPath, OutputPath))
+        return createFileError(OutputPath, EC);
+    Committed = true;
+    return Error::success();
+}
+
+// Writes args.variants copies of the binary, each with its own set of random names. The names are
+// only looked up once; each variant is a fresh clone of the input with its own patched ranges.
+Error writeVariants(const NameIndex& Index, const CommandLineArgs& args)
+{
+    std::random_device Seeds;
+    for (unsigned Variant = 0; Variant < args.variants; ++Variant) {
+        std::string OutputPath = args.outputTemplate;
+        for (size_t Pos = 0; (Pos = OutputPath.find("%d", Pos)) != std::string::npos;) {
+            const std::string Number = std::to_string(Variant);
+            OutputPath.replace(Pos, 2, Number);
+            Pos += Number.size();
+        }
+        if (!args.quietMode)
+            outs() << "=== Variant " << Variant << ": " << OutputPath << " ===\n";
+
+        PatchOverlay  Overlay;
+        NameGenerator Generator(Seeds);
+        if (Error E = transformNames(Index, Overlay, Generator, args))
+            return E;
+        if (args.dryRun)
+            continue;
+        if (Error E = writePatchedCopy(args.binaryPath, OutputPath, Overlay))
+            return E;
+    }
+    return Error::success();
+}
+
+// Sequential reader for inputs that cannot be mapped or seeked, such as a pipe on stdin.
+class InputStream
+{
+public:
+    explicit InputStream(sys::fs::file_t Handle) :
+        Handle(Handle)
+    {}
+
+    // Reads exactly Buffer.size() bytes; running out of input is an error.
+    Error read(MutableArrayRef<char> Buffer)
+    {
+        while (!Buffer.empty()) {
+            Expected<size_t> ReadOrErr = sys::fs::readNativeFile(Handle, Buffer);
+            if (!ReadOrErr)
+                return ReadOrErr.takeError();
+            if (*ReadOrErr == 0)
+                return createStringError(std::errc::invalid_argument,
+                                         "unexpected end of input at offset %" PRIu64,
+                                         Position);
+            Buffer = Buffer.drop_front(*ReadOrErr);
+            Position += *ReadOrErr;
+        }
+        return Error::success();
+    }
+
+    // Appends everything up to the end of the input to Buffer.
+    Error readToEnd(SmallVectorImpl<char>& Buffer)
+    {
+        size_t OldSize = Buffer.size();
+        if (Error E = sys::fs::readNativeFileToEOF(Handle, Buffer))
+            return E;
+        Position += Buffer.size() - OldSize;
+        return Error::success();
+    }
+
+    // Copies the input unchanged to Out, up to file offset End or up to the end of the input.
+    Error forward(raw_ostream& Out, std::optional<uint64_t> End)
+    {
+        char Chunk[64 * 1024];
+        while (!End || Position < *End) {
+            size_t ChunkSize = End ? std::min<uint64_t>(sizeof(Chunk), *End - Position)
+                                   : sizeof(Chunk);
+            Expected<size_t> ReadOrErr
+                = sys::fs::readNativeFile(Handle, MutableArrayRef<char>(Chunk, ChunkSize));
+            if (!ReadOrErr)
+                return ReadOrErr.takeError();
+            if (*ReadOrErr == 0) {
+                if (!End)
+                    break;
+                return createStringError(std::errc::invalid_argument,
+                                         "unexpected end of input at offset %" PRIu64,
+                                         Position);
+            }
+            Out.write(Chunk, *ReadOrErr);
+            Position += *ReadOrErr;
+        }
+        return Error::success();
+    }
+
+    uint64_t position() const
+    {
+        return Position;
+    }
+
+private:
+    sys::fs::file_t Handle;
+    uint64_t        Position = 0;
+};
+
+// Patches one slice held in memory and writes it to Out. A slice that is not a valid Mach-O object
+// is written unchanged, like the universal-binary loop in main() skips it. ArchName comes from the
+// fat header; it is empty for a thin binary, which is parsed before its architecture is checked.
+Error patchStreamedSlice(MutableArrayRef<char>  Slice,
+                         uint64_t               SliceOffset,
+                         StringRef              ArchName,
+                         raw_ostream&           Out,
+                         NameGenerator&         Generator,
+                         const CommandLineArgs& args)
+{
+    StringRef SliceBytes(Slice.data(), Slice.size());
+    auto      skipSlice = [&](StringRef Arch) {
+        if (!args.quietMode)
+            args.log() << "--- Skipping architecture: " << Arch << " (slice offset: " << SliceOffset
+                       << ") ---\n";
+        Out.write(Slice.data(), Slice.size());
+        return Error::success();
+    };
+    if (!ArchName.empty() && !isSliceSelected(ArchName, SliceBytes, args))
+        return skipSlice(ArchName);
+
+    MemoryBufferRef                            SliceMB(StringRef(Slice.data(), Slice.size()),
+                                                       args.binaryPath);
+    Expected<std::unique_ptr<MachOObjectFile>> MachOObjOrErr
+        = ObjectFile::createMachOObjectFile(SliceMB);
+    if (auto E = MachOObjOrErr.takeError()) {
+        if (SliceOffset == 0)
+            return E;
+        errs() << "Failed to get object for architecture: " << toString(std::move(E)) << "\n";
+    } else {
+        if (ArchName.empty()) {
+            const MachO::mach_header Header = (*MachOObjOrErr)->getHeader();
+            const std::string        Arch   = archFlagName(Header.cputype, Header.cpusubtype);
+            if (!isSliceSelected(Arch, SliceBytes, args))
+                return skipSlice(Arch);
+        }
+        Expected<SliceNames> NamesOrErr = indexMachOSlice(MachOObjOrErr->get(), SliceOffset, args);
+        if (auto E = NamesOrErr.takeError()) {
+            errs() << "Failed to patch Mach-O slice: " << toString(std::move(E)) << "\n";
+        } else {
+            PatchOverlay Overlay;
+            if (Error E = transformNames(*NamesOrErr, Overlay, Generator, args))
+                return E;
+            Overlay.applyTo(Slice, SliceOffset);
+        }
+    }
+    Out.write(Slice.data(), Slice.size());
+    return Error::success();
+}
+
+// Streams the binary from In to Out, keeping only what is needed in memory: the fat header of a
+// universal binary is forwarded right away, then each slice is read, patched and written out in
+// file order. A thin binary is a single slice and therefore has to be read completely.
+Error patchStreamedBinary(InputStream&           In,
+                          raw_ostream&           Out,
+                          NameGenerator&         Generator,
+                          const CommandLineArgs& args)
+{
+    SmallVector<char, 0> Header(sizeof(MachO::fat_header));
+    if (Error E = In.read(Header))
+        return E;
+
+    const uint32_t Magic = support::endian::read32be(Header.data());
+    if (Magic != MachO::FAT_MAGIC && Magic != MachO::FAT_MAGIC_64) {
+        if (Error E = In.readToEnd(Header))
+            return E;
+        return patchStreamedSlice(Header, 0, StringRef(), Out, Generator, args);
+    }
+
+    // Read the architecture table; the header itself is never patched.
+    const bool     Is64     = Magic == MachO::FAT_MAGIC_64;
+    const size_t   ArchSize = Is64 ? sizeof(MachO::fat_arch_64) : sizeof(MachO::fat_arch);
+    const uint32_t NumArchs = support::endian::read32be(Header.data() + 4);
+    if (NumArchs > 1024)
+        return createStringError(std::errc::invalid_argument,
+                                 "implausible number of architectures in universal binary: %u",
+                                 NumArchs);
+    Header.resize(sizeof(MachO::fat_header) + NumArchs * ArchSize);
+    if (Error E = In.read(MutableArrayRef<char>(Header).drop_front(sizeof(MachO::fat_header))))
+        return E;
+    Out.write(Header.data(), Header.size());
+
+    struct SliceExtent
+    {
+        uint64_t    Offset;
+        uint64_t    Size;
+        std::string ArchName;
+    };
+    SmallVector<SliceExtent, 4> Slices;
+    for (uint32_t Index = 0; Index < NumArchs; ++Index) {
+        const char*       Arch     = Header.data() + sizeof(MachO::fat_header) + Index * ArchSize;
+        const std::string ArchName = archFlagName(support::endian::read32be(Arch),
+                                                  support::endian::read32be(Arch + 4));
+        if (Is64)
+            Slices.push_back({support::endian::read64be(Arch + 8),
+                              support::endian::read64be(Arch + 16),
+                              ArchName});
+        else
+            Slices.push_back({support::endian::read32be(Arch + 8),
+                              support::endian::read32be(Arch + 12),
+                              ArchName});
+    }
+    llvm::sort(Slices, [](const SliceExtent& A, const SliceExtent& B) {
+        return A.Offset < B.Offset;
+    });
+
+    std::vector<char> Slice;
+    for (const SliceExtent& Extent : Slices) {
+        if (Extent.Offset < In.position())
+            return createStringError(std::errc::invalid_argument,
+                                     "overlapping slices in universal binary at offset %" PRIu64,
+                                     Extent.Offset);
+        if (Error E = In.forward(Out, Extent.Offset))
+            return E;
+
+        Slice.resize(Extent.Size);
+        if (Error E = In.read(Slice))
+            return E;
+        if (Error E
+            = patchStreamedSlice(Slice, Extent.Offset, Extent.ArchName, Out, Generator, args))
+            return E;
+    }
+    return In.forward(Out, std::nullopt);
+}
+
+// Patches a binary that is read from stdin and/or written to stdout.
+Error patchStream(const CommandLineArgs& args)
+{
+    sys::fs::file_t InHandle   = sys::fs::getStdinHandle();
+    int             InFD       = -1;
+    auto            CloseInput = make_scope_exit([&] {
+        if (InFD != -1)
+            sys::Process::SafelyCloseFileDescriptor(InFD);
+    });
+    // Permissions for a written output file: those of the input, or those of a freshly linked
+    // binary when reading from stdin.
+    sys::fs::perms OutputPerms = sys::fs::all_all;
+    if (args.binaryPath != "-") {
+        if (std::error_code EC = sys::fs::openFileForRead(args.binaryPath, InFD))
+            return createFileError(args.binaryPath, EC);
+        sys::fs::file_status Status;
+        if (std::error_code EC = sys::fs::status(InFD, Status))
+            return createFileError(args.binaryPath, EC);
+        OutputPerms = Status.permissions();
+        InHandle    = sys::fs::convertFDToNativeFile(InFD);
+    }
+
+    // A file output is assembled in a temporary file and renamed into place once complete.
+    std::optional<sys::fs::TempFile> TempOut;
+    std::unique_ptr<raw_fd_ostream>  FileOut;
+    raw_ostream*                     Out = &nulls();
+    if (!args.dryRun && args.outputPath == "-") {
+        Out = &outs();
+    } else if (!args.dryRun) {
+        Expected<sys::fs::TempFile> TempOrErr
+            = sys::fs::TempFile::create(args.outputPath + ".tmp-%%%%%%%%", OutputPerms);
+        if (!TempOrErr)
+            return TempOrErr.takeError();
+        TempOut.emplace(std::move(*TempOrErr));
+        FileOut = std::make_unique<raw_fd_ostream>(TempOut->FD, /*shouldClose=*/false);
+        Out     = FileOut.get();
+    }
+
+    InputStream  In(InHandle);
+    std::random_device Seeds;
+    NameGenerator      Generator(Seeds);
+    Error              Result = patchStreamedBinary(In, *Out, Generator, args);
+    Out->flush();
+    if (FileOut && FileOut->has_error() && !Result)
+        Result = createFileError(TempOut->TmpName, FileOut->error());
+    FileOut.reset();
+
+    if (TempOut) {
+        if (Result)
+            return joinErrors(std::move(Result), TempOut->discard());
+        return TempOut->keep(args.outputPath);
+    }
+    return Result;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // All command line parsing is now handled in this function.
+    auto argsOpt = parseCommandLine(argc, argv);
+    if (!argsOpt) {
+        // Error message or help text was already printed by the parser.
+        return 1;
+    }
+    // Use the returned struct for all arguments.
+    const auto& args = *argsOpt;
+
+    auto PrintStats = make_scope_exit([&] {
+        if (args.stats)
+            args.log() << "\nStatistics: " << HotLoopStats.Names << " names transformed, "
+                       << HotLoopStats.Collisions << " name collisions resolved with "
+                       << HotLoopStats.Retries << " retries, " << HotLoopStats.Allocations
+                       << " heap allocations in the per-name loops, " << HotLoopStats.Categories
+                       << " category names read from __objc_catlist, "
+                       << HotLoopStats.FixedUpCategories << " of them through chained fixups\n";
+    });
+
+    // Pipes are processed piece by piece instead of being mapped.
+    if (args.isStreaming()) {
+        if (Error E = patchStream(args)) {
+            errs() << "Error patching binary: " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+        if (!args.quietMode) {
+            if (args.dryRun)
+                args.log() << "\nDry run complete. Binary was not modified.\n";
+            else
+                args.log() << "\nSuccessfully wrote patched binary: "
+                           << (args.outputPath == "-" ? "<stdout>" : args.outputPath) << "\n";
+        }
+        return 0;
+    }
+
+    // Map the binary once; LLVM parses it from the same bytes the patchers read. The patches are
+    // collected in an overlay and only materialized when the output is written, so a dry run never
+    // copies the input. In mmap mode the mapping is shared and writable and the overlay is applied
+    // to it at the end, so only the pages holding patched names are dirtied and written back.
+    const bool useMmap = args.writeMode == WriteMode::Mmap && !args.dryRun;
+
+    std::unique_ptr<MemoryBuffer> FileMB;
+    MutableArrayRef<char>         MappedBytes;
+    if (useMmap) {
+        ErrorOr<std::unique_ptr<WriteThroughMemoryBuffer>> MappedOrErr
+            = WriteThroughMemoryBuffer::getFile(args.binaryPath);
+        if (std::error_code EC = MappedOrErr.getError()) {
+            errs() << "Error mapping file for writing: " << EC.message() << "\n";
+            return 1;
+        }
+        MappedBytes = (*MappedOrErr)->getBuffer();
+        FileMB      = std::move(*MappedOrErr);
+    } else {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> MBOrErr = MemoryBuffer::getFile(
+            args.binaryPath, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (std::error_code EC = MBOrErr.getError()) {
+            errs() << "Error reading file into buffer: " << EC.message() << "\n";
+            return 1;
+        }
+        FileMB = std::move(*MBOrErr);
+    }
+    PatchOverlay Overlay;
+
+    if (!args.applyPlanPath.empty()) {
+        // Replay a recorded plan; the binary is not parsed at all.
+        if (Error E = applyPatchPlan(args.applyPlanPath, FileMB->getBuffer(), Overlay, args)) {
+            errs() << "Error applying patch plan: " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+    } else {
+        NameIndex Index;
+        if (Error E = indexBinaryCached(FileMB->getMemBufferRef(), Index, args)) {
+            errs() << "Error patching binary: " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+        if (args.variants != 0) {
+            // Every variant reuses the index; only the new names differ.
+            if (Error E = writeVariants(Index, args)) {
+                errs() << "Error writing variant: " << toString(std::move(E)) << "\n";
+                return 1;
+            }
+            if (!args.quietMode) {
+                if (args.dryRun)
+                    outs() << "\nDry run complete. Binary was not modified.\n";
+                else
+                    outs() << "\nSuccessfully wrote " << args.variants << " patched variants.\n";
+            }
+            return 0;
+        }
+
+        NameMapping Mapping;
+        if (!args.mappingDatabasePath.empty()) {
+            if (Error E = Mapping.load(args.mappingDatabasePath)) {
+                errs() << "Error reading name mapping database: " << toString(std::move(E))
+                       << "\n";
+                return 1;
+            }
+        }
+
+        std::random_device Seeds;
+        NameGenerator      Generator(Seeds);
+        if (Error E = transformNames(Index,
+                                     Overlay,
+                                     Generator,
+                                     args,
+                                     args.mappingDatabasePath.empty() ? nullptr : &Mapping)) {
+            errs() << "Error: " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+        if (!args.mappingDatabasePath.empty() && !args.dryRun) {
+            if (Error E = Mapping.store(args.mappingDatabasePath)) {
+                errs() << "Error writing name mapping database: " << toString(std::move(E))
+                       << "\n";
+                return 1;
+            }
+        }
+        if (!args.exportPlanPath.empty()) {
+            if (Error E = writePatchPlan(
+                    args.exportPlanPath, FileMB->getBuffer(), Index, Overlay)) {
+                errs() << "Error writing patch plan: " << toString(std::move(E)) << "\n";
+                return 1;
+            }
+        }
+    }
+
+    if (args.dryRun) {
+        if (!args.quietMode) {
+            outs() << "\nDry run complete. Binary was not modified (" << Overlay.totalBytes()
+                   << " bytes in " << Overlay.size() << " ranges would be patched).\n";
+        }
+        return 0;
+    }
+
+    if (useMmap) {
+        // Patch the shared mapping; the kernel writes the dirty pages back.
+        Overlay.applyTo(MappedBytes);
+        if (!args.quietMode)
+            outs() << "\nSuccessfully patched binary in-place (mmap): " << args.binaryPath << "\n";
+        return 0;
+    }
+
+    if (args.writeMode == WriteMode::Pwrite) {
+        // Write just the patched ranges into the existing file.
+        int FD = -1;
+        if (std::error_code EC = sys::fs::openFileForReadWrite(
+                args.binaryPath, FD, sys::fs::CD_OpenExisting, sys::fs::OF_None)) {
+            errs() << "Error opening file for writing: " << EC.message() << "\n";
+            return 1;
+        }
+        Error WriteErr = writePatches(FD, Overlay);
+        sys::Process::SafelyCloseFileDescriptor(FD);
+        if (WriteErr) {
+            errs() << "Error writing patched ranges: " << toString(std::move(WriteErr)) << "\n";
+            return 1;
+        }
+        if (!args.quietMode) {
+            outs() << "\nSuccessfully patched binary in-place (" << Overlay.totalBytes()
+                   << " bytes in " << Overlay.size() << " ranges): " << args.binaryPath << "\n";
+        }
+        return 0;
+    }
+
+    // Patch a clone of the input and move it into place.
+    const std::string& OutputPath = args.outputPath.empty() ? args.binaryPath : args.outputPath;
+    if (Error E = writePatchedCopy(args.binaryPath, OutputPath, Overlay)) {
+        errs() << "Error writing patched binary: " << toString(std::move(E)) << "\n";
+        return 1;
+    }
+
+    if (!args.quietMode) {
+        if (args.outputPath.empty())
+            outs() << "\nSuccessfully patched binary in-place: " << args.binaryPath << "\n";
+        else
+            outs() << "\nSuccessfully wrote patched binary: " << OutputPath << "\n";
+    }
 
     return 0;
 }
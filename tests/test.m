@@ -4,6 +4,9 @@
 __attribute__((objc_root_class))
 @interface TestClass_Suffix
 + (id)new;
+@end
+
+@interface TestClass_Suffix (SomeCategory)
 - (void)printClassName;
 @end
 
@@ -11,6 +14,9 @@ __attribute__((objc_root_class))
 + (id)new {
     return class_createInstance(self, 0);
 }
+@end
+
+@implementation TestClass_Suffix (SomeCategory)
 - (void)printClassName {
     const char *name = object_getClassName(self);
     printf("%s\n", name);